@@ -0,0 +1,838 @@
+// Google Benchmark suite for the portfolio core.
+//
+// Build and run (results as JSON):
+//   g++ -std=c++17 -O2 -pthread -o portfolio_benchmarks benchmarks.cpp -lbenchmark
+//   ./portfolio_benchmarks --benchmark_out=results.json --benchmark_out_format=json
+//
+// Every benchmark is parameterized over portfolio sizes from 10 to 10M
+// entities; use --benchmark_filter to narrow a run. Files are written to a
+// scratch directory that is removed afterwards.
+
+#define PMS_NO_MAIN
+#include "src.cpp"
+
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <random>
+
+// Discards everything written to it
+class NullBuffer : public streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+// Discards the console messages the core prints while a benchmark runs
+class QuietCout
+{
+private:
+    NullBuffer discard;
+    streambuf *saved;
+
+public:
+    QuietCout() : saved(cout.rdbuf(&discard)) {}
+    ~QuietCout() { cout.rdbuf(saved); }
+};
+
+// Synthetic data
+
+static string entityName(size_t i)
+{
+    return "entity" + to_string(i);
+}
+
+static EntityType entityTypeFor(size_t i)
+{
+    return static_cast<EntityType>(i % entityTypeCount);
+}
+
+static double entityValueFor(size_t i)
+{
+    double value = 1 + static_cast<double>((i * 2654435761u) % 100000) / 100;
+    return entityTypeFor(i) == EntityType::Liability ? -value : value;
+}
+
+static const vector<string> &entityNames(size_t count)
+{
+    static map<size_t, vector<string>> cache;
+    vector<string> &names = cache[count];
+    if (names.empty())
+    {
+        names.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            names.push_back(entityName(i));
+        }
+    }
+    return names;
+}
+
+static void fillPortfolio(PortfolioManager &portfolio, size_t count)
+{
+    const vector<string> &names = entityNames(count);
+    portfolio.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        portfolio.loadEntity(names[i], entityValueFor(i), entityTypeFor(i));
+    }
+}
+
+// Shared read-only portfolios, built once per size. Benchmarks that trade,
+// save or build an index use ownPortfolio instead, so nothing they change
+// is seen by the others and results do not depend on the order they run in.
+static const PortfolioManager &cachedPortfolio(size_t count)
+{
+    static map<size_t, PortfolioManager> cache;
+    auto it = cache.find(count);
+    if (it == cache.end())
+    {
+        it = cache.emplace(count, PortfolioManager()).first;
+        fillPortfolio(it->second, count);
+    }
+    return it->second;
+}
+
+// A portfolio private to one benchmark, kept across its runs at one size.
+// Only the latest is kept, so memory stays bounded at 10M entities.
+static PortfolioManager &ownPortfolio(const string &owner, size_t count)
+{
+    static string currentOwner;
+    static size_t currentCount = 0;
+    static unique_ptr<PortfolioManager> portfolio;
+
+    if (!portfolio || owner != currentOwner || count != currentCount)
+    {
+        portfolio.reset();
+        portfolio = make_unique<PortfolioManager>();
+        fillPortfolio(*portfolio, count);
+        currentOwner = owner;
+        currentCount = count;
+    }
+    return *portfolio;
+}
+
+static string benchUser(size_t count)
+{
+    return "bench" + to_string(count);
+}
+
+static void writeWatchlist(const string &username, size_t count)
+{
+    ofstream file(username + "_watchlist.txt", ios::trunc);
+    for (size_t i = 0; i < count; i++)
+    {
+        double price = 10 + static_cast<double>(i % 1000);
+        file << entityName(i) << "," << price << "," << price << "\n";
+    }
+    file.close();
+    remove((username + "_watchlist.log").c_str());
+}
+
+static void sizes(benchmark::internal::Benchmark *benchmark)
+{
+    benchmark->RangeMultiplier(10)->Range(10, 10000000)->Unit(benchmark::kMicrosecond);
+}
+
+// PortfolioManager
+
+static void BM_AddEntity(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    const vector<string> &names = entityNames(count);
+
+    for (auto _ : state)
+    {
+        PortfolioManager portfolio;
+        for (size_t i = 0; i < count; i++)
+        {
+            portfolio.addEntity(names[i], entityValueFor(i), entityTypeName(entityTypeFor(i)));
+        }
+        benchmark::DoNotOptimize(portfolio.getTotalValue());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_AddEntity)->Apply(sizes);
+
+static void BM_SearchEntity(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    const PortfolioManager &portfolio = cachedPortfolio(count);
+    const vector<string> &names = entityNames(count);
+    mt19937_64 random(42);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.searchEntity(names[random() % count]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SearchEntity)->Apply(sizes);
+
+static void BM_GetTotalValue(benchmark::State &state)
+{
+    const PortfolioManager &portfolio = cachedPortfolio(static_cast<size_t>(state.range(0)));
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.getTotalValue());
+    }
+}
+BENCHMARK(BM_GetTotalValue)->Apply(sizes);
+
+static void BM_BuySell(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    PortfolioManager &portfolio = ownPortfolio("BM_BuySell", count);
+    const vector<string> &names = entityNames(count);
+    size_t i = 0;
+
+    for (auto _ : state)
+    {
+        const string &name = names[(i++ % (count / 3)) * 3];
+        portfolio.buyEntity(name, 1);
+        portfolio.sellEntity(name, 1);
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_BuySell)->Apply(sizes);
+
+// A rebalance of count orders, a buy and a sell of the same size per asset
+static void BM_ExecuteBatch(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    PortfolioManager &portfolio = ownPortfolio("BM_ExecuteBatch", count);
+    const vector<string> &names = entityNames(count);
+
+    vector<TradeOrder> orders;
+    orders.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        orders.push_back(TradeOrder{names[(i / 2 % (count / 3)) * 3], i % 2 ? TradeSide::Sell : TradeSide::Buy, 1});
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.executeBatch(orders, true));
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_ExecuteBatch)->Apply(sizes);
+
+// Positions spread over count / 100 symbols, so a tick re-marks about 100
+static PortfolioManager &linkedPortfolio(size_t count)
+{
+    static map<size_t, PortfolioManager> cache;
+    auto it = cache.find(count);
+    if (it == cache.end())
+    {
+        it = cache.emplace(count, PortfolioManager()).first;
+        PortfolioManager &portfolio = it->second;
+        const vector<string> &names = entityNames(count);
+        size_t symbols = max<size_t>(1, count / 100);
+
+        fillPortfolio(portfolio, count);
+        for (size_t i = 0; i < count; i++)
+        {
+            portfolio.linkPosition(names[i], "SYM" + to_string(i % symbols), static_cast<double>(i % 7 + 1));
+        }
+        for (size_t i = 0; i < symbols; i++)
+        {
+            portfolio.updatePrice("SYM" + to_string(i), 10);
+        }
+    }
+    return it->second;
+}
+
+static void BM_UpdatePrice(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    PortfolioManager &portfolio = linkedPortfolio(count);
+    size_t symbols = max<size_t>(1, count / 100);
+    vector<string> names;
+    for (size_t i = 0; i < symbols; i++)
+    {
+        names.push_back("SYM" + to_string(i));
+    }
+    size_t i = 0;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.updatePrice(names[i % symbols], 10 + static_cast<double>(i % 5)));
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UpdatePrice)->Apply(sizes);
+
+static void BM_RevalueAll(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    PortfolioManager &portfolio = linkedPortfolio(count);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.revalueAll());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_RevalueAll)->Apply(sizes);
+
+// PortfolioAnalytics
+
+static void BM_AnalyticsTotals(benchmark::State &state)
+{
+    const PortfolioManager &portfolio = cachedPortfolio(static_cast<size_t>(state.range(0)));
+    PortfolioAnalytics analytics;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(analytics.totalAssets(portfolio));
+        benchmark::DoNotOptimize(analytics.totalLiabilities(portfolio));
+        benchmark::DoNotOptimize(analytics.totalEquities(portfolio));
+    }
+}
+BENCHMARK(BM_AnalyticsTotals)->Apply(sizes);
+
+static void BM_AnalyticsRecompute(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    const PortfolioManager &portfolio = cachedPortfolio(count);
+    PortfolioAnalytics analytics;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(analytics.recompute(portfolio));
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_AnalyticsRecompute)->Apply(sizes);
+
+static void BM_EntityDistribution(benchmark::State &state)
+{
+    const PortfolioManager &portfolio = cachedPortfolio(static_cast<size_t>(state.range(0)));
+    PortfolioAnalytics analytics;
+    QuietCout quiet;
+
+    for (auto _ : state)
+    {
+        analytics.entityDistribution(portfolio);
+    }
+}
+BENCHMARK(BM_EntityDistribution)->Apply(sizes);
+
+// RiskAnalytics, over ten years of daily returns for up to 5,000 assets.
+// The second argument is the number of worker threads, 0 for inline.
+
+static const DenseMatrix &dailyReturns(size_t assets)
+{
+    static map<size_t, DenseMatrix> cache;
+    auto it = cache.find(assets);
+    if (it == cache.end())
+    {
+        mt19937_64 random(assets);
+        normal_distribution<double> daily(0.0003, 0.015);
+        DenseMatrix returns(assets, 2520);
+        for (size_t i = 0; i < assets; i++)
+        {
+            for (size_t t = 0; t < returns.columns(); t++)
+            {
+                returns(i, t) = daily(random);
+            }
+        }
+        it = cache.emplace(assets, std::move(returns)).first;
+    }
+    return it->second;
+}
+
+static void riskSizes(benchmark::internal::Benchmark *benchmark)
+{
+    for (int64_t assets : {100, 1000, 5000})
+    {
+        for (int64_t threads : {0, 1, 2, 4, 8})
+        {
+            benchmark->Args({assets, threads});
+        }
+    }
+    benchmark->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+static unique_ptr<WorkStealingPool> riskPool(const benchmark::State &state)
+{
+    size_t threads = static_cast<size_t>(state.range(1));
+    return threads ? make_unique<WorkStealingPool>(threads) : nullptr;
+}
+
+static void BM_Covariance(benchmark::State &state)
+{
+    const DenseMatrix &returns = dailyReturns(static_cast<size_t>(state.range(0)));
+    unique_ptr<WorkStealingPool> pool = riskPool(state);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(RiskAnalytics::covariance(returns, pool.get()));
+    }
+
+    // Multiply-adds over the upper triangle, two flops each
+    double assets = static_cast<double>(returns.rows());
+    state.counters["flops"] = benchmark::Counter(assets * (assets + 1) * returns.columns() * state.iterations(),
+                                                 benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Covariance)->Apply(riskSizes);
+
+static void BM_RollingVolatility(benchmark::State &state)
+{
+    const DenseMatrix &returns = dailyReturns(static_cast<size_t>(state.range(0)));
+    unique_ptr<WorkStealingPool> pool = riskPool(state);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(RiskAnalytics::rollingVolatility(returns, 21, pool.get()));
+    }
+}
+BENCHMARK(BM_RollingVolatility)->Apply(riskSizes);
+
+static void BM_HistoricalVaR(benchmark::State &state)
+{
+    const DenseMatrix &returns = dailyReturns(static_cast<size_t>(state.range(0)));
+    unique_ptr<WorkStealingPool> pool = riskPool(state);
+    vector<double> weights(returns.rows(), 1000);
+
+    for (auto _ : state)
+    {
+        vector<double> pnl = RiskAnalytics::portfolioReturns(returns, weights, pool.get());
+        benchmark::DoNotOptimize(RiskAnalytics::historicalVaR(pnl, 0.99));
+    }
+}
+BENCHMARK(BM_HistoricalVaR)->Apply(riskSizes);
+
+// MonteCarloEngine: 100,000 paths of 21 daily steps for a 20-position
+// portfolio, at 1 to 8 worker threads. Paths are reproducible at any
+// thread count, so the work per run is identical and items per second
+// should grow with the threads up to the number of cores.
+static void BM_MonteCarlo(benchmark::State &state)
+{
+    PortfolioManager portfolio;
+    for (size_t i = 0; i < 20; i++)
+    {
+        portfolio.loadEntity(entityName(i), 1000, EntityType::Asset);
+    }
+    portfolio.loadEntity("loan", -5000, EntityType::Liability);
+
+    ScenarioModel model = ScenarioModel::fromPortfolio(portfolio, 0.0003, 0.01);
+    WorkStealingPool pool(static_cast<size_t>(state.range(0)));
+    const size_t paths = 100000, steps = 21;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(MonteCarloEngine::simulate(model, paths, steps, 1, &pool));
+    }
+    state.SetItemsProcessed(state.iterations() * paths * steps * model.values.size());
+}
+BENCHMARK(BM_MonteCarlo)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// ConcurrentPortfolio under a mixed load: each thread does nine snapshot
+// reads (net value) for every trade on a 100,000-entity book. Readers take
+// no lock, so throughput should hold up as threads are added while the one
+// writer lock serializes only the trades.
+static void BM_ConcurrentMixed(benchmark::State &state)
+{
+    static unique_ptr<PortfolioManager> portfolio;
+    static unique_ptr<ConcurrentPortfolio> shared;
+    const size_t count = 100000;
+    const vector<string> &names = entityNames(count);
+
+    if (state.thread_index() == 0)
+    {
+        portfolio = make_unique<PortfolioManager>();
+        fillPortfolio(*portfolio, count);
+        shared = make_unique<ConcurrentPortfolio>(*portfolio);
+    }
+
+    size_t op = static_cast<size_t>(state.thread_index()) * 7919;
+    for (auto _ : state)
+    {
+        if (++op % 10 == 0)
+        {
+            const string &name = names[(op / 10) % count];
+            benchmark::DoNotOptimize(op % 20 == 0 ? shared->buyEntity(name, 1) : shared->sellEntity(name, 1));
+        }
+        else
+        {
+            benchmark::DoNotOptimize(shared->getTotalValue());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        shared.reset();
+        portfolio.reset();
+    }
+}
+BENCHMARK(BM_ConcurrentMixed)->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+// SessionServer through LoopbackClient. The first run plays a scripted
+// session and fails the benchmark if any reply differs from the protocol;
+// then each thread logs in as its own user and alternates BUY and TOTAL.
+// Users land on different shards, so trades can proceed in parallel.
+static SessionServer &loopbackServer()
+{
+    static SessionServer *server = [] {
+        ofstream users("users.txt", ios::app);
+        users << "loopcheck,pw\n";
+        for (int i = 0; i < 8; i++)
+        {
+            users << "loop" << i << ",pw\n";
+        }
+        users.close();
+        return new SessionServer(8);
+    }();
+    return *server;
+}
+
+// Empty if the scripted session got the expected reply to every line
+static string loopbackProtocolErrors()
+{
+    static const string errors = [] {
+        const pair<const char *, const char *> script[] = {
+            {"TOTAL", "ERR not logged in\n"},
+            {"LOGIN loopcheck nope", "ERR Invalid username or password.\n"},
+            {"LOGIN loopcheck pw", "OK Welcome, loopcheck.\n"},
+            {"ADD Gold 100 Asset", "OK 100\n"},
+            {"ADD Loan -40 Liability", "OK -40\n"},
+            {"ADD Debt 40 Liability", "ERR Liability value has the wrong sign\n"},
+            {"BUY Gold 5", "OK 105\n"},
+            {"SELL Gold 500", "ERR Insufficient value to complete the transaction.\n"},
+            {"SELL Silver 1", "ERR Entity not found.\n"},
+            {"TOTAL", "OK 65\n"},
+            {"REPORT", "OK\nTotal Assets: $105\nTotal Liabilities: $-40\nTotal Equities: $0\nNet Portfolio Value: $65\n"},
+            {"SHOW", "OK\nAsset,Gold,105\nLiability,Loan,-40\n"},
+            {"TOP Asset 5", "OK\nAsset,Gold,105\n"},
+            {"FIND prefix go", "OK\nAsset,Gold,105\n"},
+            {"FIND fuzzy Lona", "OK\nLiability,Loan,-40\n"},
+            {"HELLO", "ERR unknown command HELLO\n"},
+            {"QUIT", "OK\n"},
+        };
+
+        LoopbackClient client(loopbackServer());
+        string errors;
+        for (const auto &step : script)
+        {
+            string reply = client.send(step.first);
+            if (reply != step.second)
+            {
+                errors += string(step.first) + " -> " + reply;
+            }
+        }
+        return errors;
+    }();
+    return errors;
+}
+
+static void BM_ServerLoopback(benchmark::State &state)
+{
+    string errors = loopbackProtocolErrors();
+    if (!errors.empty())
+    {
+        state.SkipWithError(("unexpected replies: " + errors).c_str());
+        return;
+    }
+
+    LoopbackClient client(loopbackServer());
+    client.send("LOGIN loop" + to_string(state.thread_index()) + " pw");
+    client.send("ADD Cash 1 Asset");
+
+    for (auto _ : state)
+    {
+        string bought = client.send("BUY Cash 1");
+        string total = client.send("TOTAL");
+        if (bought.compare(0, 3, "OK ") != 0 || total.compare(0, 3, "OK ") != 0)
+        {
+            state.SkipWithError(("unexpected reply: " + bought + total).c_str());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_ServerLoopback)->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+// Entity representations: per-type totals through tag dispatch over the
+// entity objects, to compare with the columnar pass in BM_AnalyticsRecompute
+
+static void BM_TotalsTagged(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    const PortfolioManager &portfolio = cachedPortfolio(count);
+
+    for (auto _ : state)
+    {
+        double totals[entityTypeCount] = {};
+        for (const auto &pair : portfolio.getEntities())
+        {
+            visitEntity(*pair.second, [&totals](const auto &entity) {
+                totals[static_cast<size_t>(remove_reference_t<decltype(entity)>::tag)] += entity.getValue();
+            });
+        }
+        benchmark::DoNotOptimize(totals);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_TotalsTagged)->Apply(sizes);
+
+// FileHandler
+
+static void BM_SavePortfolio(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    PortfolioManager &portfolio = ownPortfolio("BM_SavePortfolio", count);
+    FileHandler files;
+
+    for (auto _ : state)
+    {
+        files.compactPortfolio(portfolio, benchUser(count));
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_SavePortfolio)->Apply(sizes);
+
+// One changed entity per save; the delta file is compacted whenever it
+// outgrows half the base
+static void BM_SavePortfolioDelta(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    PortfolioManager &portfolio = ownPortfolio("BM_SavePortfolioDelta", count);
+    const vector<string> &names = entityNames(count);
+    FileHandler files;
+    files.compactPortfolio(portfolio, benchUser(count));
+    size_t i = 0;
+
+    for (auto _ : state)
+    {
+        portfolio.buyEntity(names[(i++ % (count / 3)) * 3], 1);
+        files.savePortfolio(portfolio, benchUser(count));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SavePortfolioDelta)->Apply(sizes);
+
+static void BM_LoadPortfolioSnapshot(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    FileHandler files;
+    files.compactPortfolio(ownPortfolio("BM_LoadPortfolioSnapshot", count), benchUser(count));
+
+    for (auto _ : state)
+    {
+        PortfolioManager portfolio;
+        files.loadPortfolio(portfolio, benchUser(count));
+        benchmark::DoNotOptimize(portfolio.getTotalValue());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_LoadPortfolioSnapshot)->Apply(sizes);
+
+static void BM_LoadPortfolioCsv(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    FileHandler files;
+    files.compactPortfolio(ownPortfolio("BM_LoadPortfolioCsv", count), benchUser(count));
+    remove(PortfolioSnapshot::filenameFor(benchUser(count)).c_str());
+
+    for (auto _ : state)
+    {
+        PortfolioManager portfolio;
+        files.loadPortfolio(portfolio, benchUser(count));
+        benchmark::DoNotOptimize(portfolio.getTotalValue());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_LoadPortfolioCsv)->Apply(sizes);
+
+// Watchlist
+
+static void BM_WatchlistLoad(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    string username = benchUser(count);
+    writeWatchlist(username, count);
+    QuietCout quiet;
+
+    for (auto _ : state)
+    {
+        Watchlist watchlist;
+        watchlist.track_performance(username);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_WatchlistLoad)->Apply(sizes);
+
+static void BM_WatchlistAddRemove(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    string username = benchUser(count);
+    writeWatchlist(username, count);
+    Watchlist watchlist(false);
+    QuietCout quiet;
+    watchlist.track_performance(username);
+
+    for (auto _ : state)
+    {
+        watchlist.add_asset(username, "extra", 100);
+        watchlist.remove_asset(username, "extra");
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_WatchlistAddRemove)->Apply(sizes);
+
+static void BM_WatchlistUpdatePrice(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    string username = benchUser(count);
+    writeWatchlist(username, count);
+    const vector<string> &names = entityNames(count);
+    Watchlist watchlist(false);
+    QuietCout quiet;
+    watchlist.track_performance(username);
+    size_t i = 0;
+
+    for (auto _ : state)
+    {
+        watchlist.update_price(username, names[i % count], static_cast<double>(i % 977));
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WatchlistUpdatePrice)->Apply(sizes);
+
+static void BM_WatchlistTrackPerformance(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    string username = benchUser(count);
+    writeWatchlist(username, count);
+    Watchlist watchlist;
+    QuietCout quiet;
+    watchlist.track_performance(username);
+
+    for (auto _ : state)
+    {
+        watchlist.track_performance(username);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_WatchlistTrackPerformance)->Apply(sizes);
+
+static void BM_WatchlistNotify(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    string username = benchUser(count);
+    writeWatchlist(username, count);
+    Watchlist watchlist;
+    QuietCout quiet;
+    watchlist.notify_significant_changes(username, 10);
+
+    for (auto _ : state)
+    {
+        watchlist.notify_significant_changes(username, 10);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_WatchlistNotify)->Apply(sizes);
+
+static void BM_WatchlistIngest(benchmark::State &state)
+{
+    size_t count = static_cast<size_t>(state.range(0));
+    string username = benchUser(count);
+    writeWatchlist(username, count);
+
+    string feed = username + "_feed.csv";
+    {
+        ofstream file(feed, ios::trunc);
+        for (size_t i = 0; i < count; i++)
+        {
+            file << entityName(i) << "," << 10 + static_cast<double>((i * 7) % 1000) << "," << i << "\n";
+        }
+    }
+
+    Watchlist watchlist(false);
+    QuietCout quiet;
+
+    for (auto _ : state)
+    {
+        watchlist.ingest_ticks(username, feed, 10);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_WatchlistIngest)->Apply(sizes);
+
+// Sorted views; the first query builds the value index
+static void BM_TopEntities(benchmark::State &state)
+{
+    PortfolioManager &portfolio = ownPortfolio("BM_TopEntities", static_cast<size_t>(state.range(0)));
+    portfolio.topEntities(EntityType::Asset, 1);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.topEntities(EntityType::Asset, 20));
+    }
+}
+BENCHMARK(BM_TopEntities)->Apply(sizes);
+
+// Name searches; the first query builds the name index
+static void BM_SearchPrefix(benchmark::State &state)
+{
+    PortfolioManager &portfolio = ownPortfolio("BM_SearchPrefix", static_cast<size_t>(state.range(0)));
+    portfolio.searchPrefix("entity", 1);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.searchPrefix("Entity12", 20));
+    }
+}
+BENCHMARK(BM_SearchPrefix)->Apply(sizes);
+
+static void BM_SearchSubstring(benchmark::State &state)
+{
+    PortfolioManager &portfolio = ownPortfolio("BM_SearchSubstring", static_cast<size_t>(state.range(0)));
+    portfolio.searchPrefix("entity", 1);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.searchSubstring("y345", 20));
+    }
+}
+BENCHMARK(BM_SearchSubstring)->Apply(sizes);
+
+static void BM_SearchFuzzy(benchmark::State &state)
+{
+    PortfolioManager &portfolio = ownPortfolio("BM_SearchFuzzy", static_cast<size_t>(state.range(0)));
+    portfolio.searchPrefix("entity", 1);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(portfolio.searchFuzzy("entiyt345", 2, 20));
+    }
+}
+BENCHMARK(BM_SearchFuzzy)->Apply(sizes);
+
+int main(int argc, char **argv)
+{
+    char scratch[] = "/tmp/portfolio_benchmarks.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0)
+    {
+        cerr << "Could not create a scratch directory\n";
+        return 1;
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    error_code error;
+    filesystem::remove_all(scratch, error);
+    return error ? 1 : 0;
+}
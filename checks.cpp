@@ -0,0 +1,436 @@
+// Correctness checks for the portfolio core, alongside the benchmark suite.
+//
+// Build and run; the exit status is non-zero if any check fails:
+//   g++ -std=c++17 -O2 -pthread -o portfolio_checks checks.cpp
+//   ./portfolio_checks
+//
+// Files are written to a scratch directory that is removed afterwards.
+
+#define PMS_NO_MAIN
+#include "src.cpp"
+
+#include <filesystem>
+#include <random>
+
+static size_t checksRun = 0;
+static size_t checksFailed = 0;
+
+static void expect(bool condition, const string &what)
+{
+    checksRun++;
+    if (!condition)
+    {
+        checksFailed++;
+        cerr << "FAILED: " << what << "\n";
+    }
+}
+
+static string describe(double value)
+{
+    string text;
+    appendNumber(text, value);
+    return text;
+}
+
+// Every report that shows a net value agrees on it for the same book
+static void checkNetValue()
+{
+    PortfolioManager portfolio;
+    portfolio.addEntity("Gold", 105, EntityType::Asset);
+    portfolio.addEntity("Shares", 20, EntityType::Equity);
+    portfolio.addEntity("Loan", -40, EntityType::Liability);
+
+    double summary = PortfolioAnalytics().totals(portfolio).netValue();
+    expect(summary == 85, "summary net value is assets + equities + signed liabilities, got " + describe(summary));
+
+    ScenarioModel model = ScenarioModel::fromPortfolio(portfolio, 0, 0.01);
+    double scenario = MonteCarloEngine::simulate(model, 16, 4, 1).startValue;
+    expect(scenario == summary, "scenario starting net value " + describe(scenario) + " matches the summary's " + describe(summary));
+
+    portfolio.enableHistory();
+    double risk = RiskAnalytics::build(portfolio, time(nullptr), 1, 3).netValue;
+    expect(risk == summary, "risk report net value " + describe(risk) + " matches the summary's " + describe(summary));
+}
+
+// A kernel run from inside a task on the same pool waits only for its own
+// chunks, helping with them instead of blocking the worker
+static void checkNestedPoolUse()
+{
+    PortfolioManager portfolio;
+    portfolio.enableHistory();
+    for (int i = 0; i < 200; i++)
+    {
+        portfolio.addEntity("entity" + to_string(i), 100 + i, EntityType::Asset);
+    }
+
+    time_t until = time(nullptr);
+    RiskReport direct = RiskAnalytics::build(portfolio, until, 1, 8);
+
+    WorkStealingPool pool(1);
+    promise<RiskReport> nested;
+    pool.submit([&] { nested.set_value(RiskAnalytics::build(portfolio, until, 1, 8, &pool)); });
+    future<RiskReport> result = nested.get_future();
+    bool finished = result.wait_for(chrono::seconds(30)) == future_status::ready;
+    expect(finished, "risk report built inside a task on a one-worker pool finishes");
+    if (!finished)
+    {
+        // The worker is stuck, so the pool cannot be shut down
+        quick_exit(1);
+    }
+
+    RiskReport report = result.get();
+    expect(report.names == direct.names && report.volatility == direct.volatility,
+           "risk report built on the pool matches the one built inline");
+}
+
+// Compares a ValueOrder with a std::set of the same keys, walking both in
+// each direction and probing ranks and lower bounds
+static bool sameOrder(const ValueOrder &order, const set<ValueOrder::Key> &reference, mt19937_64 &random)
+{
+    if (order.size() != reference.size() || !equal(order.begin(), order.end(), reference.begin(), reference.end()))
+    {
+        return false;
+    }
+
+    auto it = order.end();
+    for (auto expected = reference.rbegin(); expected != reference.rend(); ++expected)
+    {
+        if (*--it != *expected)
+        {
+            return false;
+        }
+    }
+
+    for (int probe = 0; probe < 32; probe++)
+    {
+        size_t rank = reference.empty() ? 0 : random() % (reference.size() + 1);
+        auto found = order.find_by_order(rank);
+        if (rank == reference.size() ? found != order.end() : *found != *next(reference.begin(), rank))
+        {
+            return false;
+        }
+
+        ValueOrder::Key key = {static_cast<double>(random() % 200), static_cast<uint32_t>(random() % 4096)};
+        auto bound = order.lower_bound(key);
+        auto expected = reference.lower_bound(key);
+        if (expected == reference.end() ? bound != order.end() : bound == order.end() || *bound != *expected)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Random inserts and erases that grow the order past many blocks, drain it
+// almost empty and grow it again, checked against std::set throughout
+static void checkValueOrder()
+{
+    mt19937_64 random(22);
+    ValueOrder order;
+    set<ValueOrder::Key> reference;
+    bool matched = true;
+
+    for (int phase = 0; phase < 3 && matched; phase++)
+    {
+        // Mostly inserts while growing, mostly erases while draining
+        bool growing = phase != 1;
+        for (int op = 0; op < 20000 && matched; op++)
+        {
+            ValueOrder::Key key = {static_cast<double>(random() % 200), static_cast<uint32_t>(random() % 4096)};
+            if (random() % 10 < (growing ? 8u : 1u))
+            {
+                if (reference.insert(key).second)
+                {
+                    order.insert(key);
+                }
+            }
+            else
+            {
+                if (!reference.empty() && random() % 2)
+                {
+                    key = *next(reference.begin(), random() % reference.size());
+                }
+                matched = order.erase(key) == reference.erase(key);
+            }
+
+            if (op % 500 == 0)
+            {
+                matched = matched && sameOrder(order, reference, random);
+            }
+        }
+        matched = matched && sameOrder(order, reference, random);
+    }
+    expect(matched, "value order matches std::set through random inserts and erases");
+
+    vector<ValueOrder::Key> keys;
+    for (uint32_t slot = 0; slot < 100000; slot++)
+    {
+        keys.push_back({static_cast<double>(slot), slot});
+    }
+    order.assign(keys);
+    for (uint32_t slot = 0; slot < 100000; slot++)
+    {
+        if (slot % 1000 != 0)
+        {
+            order.erase({static_cast<double>(slot), slot});
+        }
+    }
+    expect(order.size() == 100 && order.blockCount() <= 2,
+           "erasing most keys merges their blocks, leaving " + to_string(order.blockCount()));
+
+    size_t before = order.size();
+    bool rejected = false;
+    try
+    {
+        order.insert({nan(""), 1});
+    }
+    catch (const invalid_argument &)
+    {
+        rejected = true;
+    }
+    expect(rejected && order.size() == before && order.erase({nan(""), 1}) == 0 &&
+               order.lower_bound({nan(""), 1}) == order.end(),
+           "value order rejects NaN values");
+}
+
+// Philox4x32-10 against the known-answer vectors published with the
+// Random123 reference implementation, through both the single counter and
+// the lane-wise form
+static void checkPhilox()
+{
+    struct Vector
+    {
+        uint32_t counter[4];
+        uint32_t key[2];
+        uint32_t expected[4];
+    };
+    const Vector vectors[] = {
+        {{0x00000000, 0x00000000, 0x00000000, 0x00000000}, {0x00000000, 0x00000000},
+         {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+        {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff},
+         {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+        {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0},
+         {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+    };
+
+    for (const Vector &vector : vectors)
+    {
+        uint32_t single[4];
+        copy(vector.counter, vector.counter + 4, single);
+        Philox4x32::generate(single, vector.key[0], vector.key[1]);
+
+        uint32_t lanes[4][3];
+        for (size_t word = 0; word < 4; word++)
+        {
+            fill(lanes[word], lanes[word] + 3, vector.counter[word]);
+        }
+        Philox4x32::generate(lanes, vector.key[0], vector.key[1]);
+
+        bool matched = equal(single, single + 4, vector.expected);
+        for (size_t word = 0; word < 4; word++)
+        {
+            matched = matched && lanes[word][0] == vector.expected[word] && lanes[word][2] == vector.expected[word];
+        }
+        expect(matched, "Philox4x32-10 known answer for counter " + to_string(vector.counter[0]));
+    }
+}
+
+// The same seed gives bit-identical paths inline and at any thread count
+static void checkScenarioReproducibility()
+{
+    PortfolioManager portfolio;
+    portfolio.addEntity("Gold", 100, EntityType::Asset);
+    portfolio.addEntity("Bonds", 250, EntityType::Asset);
+    portfolio.addEntity("Shares", 75, EntityType::Equity);
+    portfolio.addEntity("Loan", -120, EntityType::Liability);
+
+    ScenarioModel model = ScenarioModel::fromPortfolio(portfolio, 0.0002, 0.012);
+    model.correlateEvenly(0.4);
+
+    // More paths than one task takes, and a count that leaves a partial batch
+    const size_t paths = 5003, steps = 30;
+    ScenarioResult direct = MonteCarloEngine::simulate(model, paths, steps, 2025);
+    for (size_t threads : {1, 3, 8})
+    {
+        WorkStealingPool pool(threads);
+        ScenarioResult pooled = MonteCarloEngine::simulate(model, paths, steps, 2025, &pool);
+        bool identical = memcmp(pooled.finalValues.data(), direct.finalValues.data(), paths * sizeof(double)) == 0 &&
+                         memcmp(pooled.worstValues.data(), direct.worstValues.data(), paths * sizeof(double)) == 0;
+        expect(identical, "scenario paths on " + to_string(threads) + " threads are bit-identical to inline");
+    }
+}
+
+static void writeFile(const string &path, const string &text)
+{
+    ofstream file(path, ios::binary | ios::trunc);
+    file << text;
+}
+
+static void appendFile(const string &path, const string &text)
+{
+    ofstream file(path, ios::binary | ios::app);
+    file << text;
+}
+
+// Same entities with the same types and values
+static bool sameBook(const PortfolioManager &a, const PortfolioManager &b)
+{
+    if (a.getEntities().size() != b.getEntities().size())
+    {
+        return false;
+    }
+    for (const auto &pair : a.getEntities())
+    {
+        auto other = b.getEntities().find(pair.first);
+        if (other == b.getEntities().end() || other->second->getTypeTag() != pair.second->getTypeTag() ||
+            other->second->getValue() != pair.second->getValue())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Replaying a user's ledger rebuilds the book the session left behind
+static void checkLedgerReplay()
+{
+    FileHandler files;
+    PortfolioManager session;
+    expect(files.restorePortfolio(session, "ledgercheck").status == FileStatus::NotFound,
+           "a new user has no saved portfolio");
+    {
+        TransactionLedger ledger(TransactionLedger::filenameFor("ledgercheck"));
+        session.attachLedger(&ledger, true);
+        session.addEntity("Gold", 100, EntityType::Asset);
+        session.addEntity("Loan", -40, EntityType::Liability);
+        session.addEntity("A name longer than one ledger record holds in a single entry", 7.25, EntityType::Equity);
+        session.buyEntity("Gold", 12.5);
+        session.sellEntity("Gold", 2.5);
+        session.addEntity("Loan", -10, EntityType::Liability);
+        session.attachLedger(nullptr, false);
+    }
+
+    PortfolioManager replayed;
+    FileResult result = files.loadCurrentPortfolio(replayed, "ledgercheck");
+    expect(result.ok() && result.fromLedger && result.warnings.empty(), "ledger replays cleanly");
+    expect(sameBook(session, replayed), "replayed book matches the session's");
+}
+
+// Saves append changed entities to a delta file until it outgrows the
+// base, then rewrite the base; every load gives back the saved book
+static void checkDeltaCompaction()
+{
+    const string user = "deltacheck";
+    const string delta = FileHandler::deltaFilenameFor(user);
+    FileHandler files;
+    PortfolioManager portfolio;
+    for (int i = 0; i < 5000; i++)
+    {
+        portfolio.addEntity("entity" + to_string(i), 100 + i, i % 3 == 1 ? EntityType::Liability : EntityType::Asset);
+    }
+
+    expect(files.savePortfolio(portfolio, user).ok() && !filesystem::exists(delta), "first save writes the base only");
+
+    for (int i = 0; i < 10; i++)
+    {
+        portfolio.buyEntity("entity" + to_string(i * 3), 1);
+    }
+    expect(files.savePortfolio(portfolio, user).ok() && filesystem::exists(delta), "small change is saved as a delta");
+
+    PortfolioManager loaded;
+    expect(files.loadPortfolio(loaded, user).ok() && sameBook(portfolio, loaded), "base plus delta loads the saved book");
+
+    // A torn last record, as from a crash mid-append, is skipped
+    appendFile(delta, "entity0,99");
+    PortfolioManager torn;
+    expect(files.loadPortfolio(torn, user).ok() && sameBook(portfolio, torn), "torn delta record is ignored");
+
+    for (int i = 0; i < 5000; i++)
+    {
+        portfolio.buyEntity("entity" + to_string(i), 1);
+    }
+    expect(files.savePortfolio(portfolio, user).ok() && !filesystem::exists(delta), "outgrown delta is compacted into the base");
+
+    PortfolioManager compacted;
+    expect(files.loadPortfolio(compacted, user).ok() && sameBook(portfolio, compacted), "compacted base loads the saved book");
+
+    remove(PortfolioSnapshot::filenameFor(user).c_str());
+    PortfolioManager fromCsv;
+    expect(files.loadPortfolio(fromCsv, user).ok() && sameBook(portfolio, fromCsv), "CSV base loads the saved book");
+}
+
+// Bad records in a saved portfolio are reported with their place and
+// skipped, and the rest still load
+static void checkCsvErrors()
+{
+    writeFile("csvcheck_portfolio.txt", "Gold,100,Asset\nBad,x,Asset\nOdd,5,Stock\nShort,1\nLoan,-50,Liability\n");
+
+    FileHandler files;
+    PortfolioManager portfolio;
+    FileResult result = files.loadPortfolio(portfolio, "csvcheck");
+    expect(result.ok() && portfolio.getEntities().size() == 2, "good records load around bad ones");
+
+    const vector<string> expected = {
+        "Error in csvcheck_portfolio.txt at line 2, column 5: invalid number 'x'",
+        "csvcheck_portfolio.txt: Odd: Invalid financial entity type!",
+        "csvcheck_portfolio.txt: Short: Invalid financial entity type!",
+    };
+    expect(result.warnings == expected, "bad records are reported by line and column, or by name");
+}
+
+// The user index follows appends and an unterminated last line without
+// rereading what it already parsed, and starts over on a replaced or
+// rewritten file
+static void checkUserIndex()
+{
+    writeFile("users.txt", "ann,one\nbob,two\n");
+    UserIndex users;
+    expect(users.checkPassword("ann", "one") && users.contains("bob") && !users.contains("cat"), "index reads the file");
+
+    appendFile("users.txt", "cat,three\nann,other\n");
+    expect(users.checkPassword("cat", "three") && users.checkPassword("ann", "one") && users.size() == 3,
+           "index picks up appends and the first record for a name wins");
+
+    appendFile("users.txt", "dan,fo");
+    expect(users.contains("dan") && users.checkPassword("dan", "fo") && users.size() == 3,
+           "unterminated line is usable but not indexed");
+    appendFile("users.txt", "ur\n");
+    expect(users.checkPassword("dan", "four") && users.size() == 4, "line is indexed once complete");
+
+    expect(users.add("eve", "five") && users.checkPassword("eve", "five"), "added user is found");
+
+    writeFile("users.next", "fay,six\n");
+    rename("users.next", "users.txt");
+    expect(users.contains("fay") && !users.contains("ann") && users.size() == 1, "replaced file is read afresh");
+
+    // Rewritten in place, so the inode stays and the file only grows
+    writeFile("users.txt", "fay,seven\nguy,eight\n");
+    expect(users.checkPassword("fay", "seven") && users.contains("guy") && users.size() == 2,
+           "file rewritten in place is read afresh");
+}
+
+int main()
+{
+    char scratch[] = "/tmp/portfolio_checks.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0)
+    {
+        cerr << "Could not create a scratch directory\n";
+        return 1;
+    }
+
+    checkNetValue();
+    checkNestedPoolUse();
+    checkValueOrder();
+    checkPhilox();
+    checkScenarioReproducibility();
+    checkLedgerReplay();
+    checkDeltaCompaction();
+    checkCsvErrors();
+    checkUserIndex();
+
+    chdir("/");
+    filesystem::remove_all(scratch);
+
+    cout << checksRun - checksFailed << " of " << checksRun << " checks passed\n";
+    return checksFailed == 0 ? 0 : 1;
+}
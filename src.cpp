@@ -3,6 +3,7 @@
 #include <string>
 #include <unordered_map>
 #include <map>
+#include <set>
 #include <fstream>
 #include <sstream>
 #include <vector>
@@ -11,916 +12,7193 @@
 #include <iomanip>
 #include <ctime>
 #include <cmath>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <future>
+#include <memory_resource>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <numeric>
+#include <string_view>
+#include <charconv>
+#include <limits>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
-class FinancialEntity
+// StringPool keeps strings in large chunks so views into it stay valid
+// for the lifetime of the pool.
+class StringPool
 {
-protected:
-    string name;
-    double currentValue;
+private:
+    static constexpr size_t chunkSize = 64 * 1024;
+    vector<unique_ptr<char[]>> chunks;
+    size_t used = chunkSize;
 
 public:
-    FinancialEntity(const string &name, double value) : name(name), currentValue(value) {}
+    string_view store(string_view text)
+    {
+        if (text.size() > chunkSize)
+        {
+            chunks.push_back(make_unique<char[]>(text.size()));
+            memcpy(chunks.back().get(), text.data(), text.size());
+            return string_view(chunks.back().get(), text.size());
+        }
 
-    virtual void showDetails() const = 0;
-    virtual double getCurrentValue() const { return currentValue; }
-    virtual string getName() const { return name; }
+        if (used + text.size() > chunkSize)
+        {
+            chunks.push_back(make_unique<char[]>(chunkSize));
+            used = 0;
+        }
 
-    void setValue(double newValue)
+        char *dest = chunks.back().get() + used;
+        memcpy(dest, text.data(), text.size());
+        used += text.size();
+        return string_view(dest, text.size());
+    }
+
+    void clear()
     {
-        currentValue = newValue;
+        chunks.clear();
+        used = chunkSize;
     }
+};
 
-    void addValue(double value)
+inline uint64_t hashString(string_view text)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text)
     {
-        currentValue += value;
+        hash = (hash ^ c) * 1099511628211ull;
     }
+    return hash;
+}
 
-    void subtractValue(double value)
+// Open-addressing (linear probing) hash index from string keys to 32-bit ids.
+// Keys are not owned: they must live in stable storage such as a StringPool.
+class FlatStringIndex
+{
+private:
+    struct Slot
     {
-        if (value <= currentValue)
+        string_view key;
+        uint64_t hash = 0;
+        uint32_t id = 0;
+        bool used = false;
+    };
+
+    vector<Slot> slots;
+    size_t count = 0;
+
+    void grow()
+    {
+        vector<Slot> old = std::move(slots);
+        slots.assign(old.empty() ? 16 : old.size() * 2, Slot());
+        count = 0;
+
+        for (const Slot &slot : old)
         {
-            currentValue -= value;
+            if (slot.used)
+            {
+                insertHashed(slot.key, slot.hash, slot.id);
+            }
         }
+    }
 
-        else
+    void insertHashed(string_view key, uint64_t hash, uint32_t id)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+
+        while (slots[i].used)
         {
-            cout << "Insufficient value to complete the transaction.\n";
+            if (slots[i].hash == hash && slots[i].key == key)
+            {
+                slots[i].id = id;
+                return;
+            }
+            i = (i + 1) & mask;
         }
-    }
-    // Helper function to determine the type of the entity (Asset, Liability, Equity)
-    virtual std::string getType() const = 0;
-    virtual ~FinancialEntity() = default;
-};
 
-// Asset Class
+        slots[i].key = key;
+        slots[i].hash = hash;
+        slots[i].id = id;
+        slots[i].used = true;
+        count++;
+    }
 
-class Asset : public FinancialEntity
-{
 public:
-    Asset(const string &name, double value) : FinancialEntity(name, value) {}
+    static constexpr uint32_t npos = UINT32_MAX;
 
-    void showDetails() const override
+    // Returns the id stored for key, or npos
+    uint32_t find(string_view key) const
     {
-        cout << "Asset Name: " << name << "\n"
-             << "Current Value: $" << currentValue << "\n";
+        if (slots.empty())
+        {
+            return npos;
+        }
+
+        uint64_t hash = hashString(key);
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = hash & mask; slots[i].used; i = (i + 1) & mask)
+        {
+            if (slots[i].hash == hash && slots[i].key == key)
+            {
+                return slots[i].id;
+            }
+        }
+        return npos;
+    }
+
+    // Inserts or overwrites key -> id
+    void insert(string_view key, uint32_t id)
+    {
+        // Keep the load factor under 0.7
+        if ((count + 1) * 10 > slots.size() * 7)
+        {
+            grow();
+        }
+        insertHashed(key, hashString(key), id);
+    }
+
+    void reserve(size_t n)
+    {
+        while (n * 10 > slots.size() * 7)
+        {
+            grow();
+        }
     }
 
-    std::string getType() const override { return "Asset"; }
+    void clear()
+    {
+        slots.clear();
+        count = 0;
+    }
+
+    size_t size() const { return count; }
 };
 
-// Liability Class
+enum class EntityType : uint8_t
+{
+    Asset,
+    Liability,
+    Equity
+};
+
+constexpr size_t entityTypeCount = 3;
+
+constexpr const char *entityTypeName(EntityType type)
+{
+    switch (type)
+    {
+        case EntityType::Asset: return "Asset";
+        case EntityType::Liability: return "Liability";
+        case EntityType::Equity: return "Equity";
+    }
+    return "Unknown";
+}
 
-class Liability : public FinancialEntity
+inline bool parseEntityType(string_view text, EntityType &type)
 {
+    if (text == "Asset") { type = EntityType::Asset; return true; }
+    if (text == "Liability") { type = EntityType::Liability; return true; }
+    if (text == "Equity") { type = EntityType::Equity; return true; }
+    return false;
+}
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+private:
+    const char *mapped = nullptr;
+    size_t length = 0;
+
 public:
-    Liability(const string &name, double value) : FinancialEntity(name, value) {}
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
 
-    void showDetails() const override
+    ~MappedFile()
     {
-        cout << "Liability Name: " << name << "\n"
-             << "Current Value: $" << currentValue << "\n";
+        close();
     }
 
-    std::string getType() const override { return "Liability"; }
-};
+    bool open(const string &path)
+    {
+        close();
 
-// Equity Class
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
 
-class Equity : public FinancialEntity
-{
-public:
-    Equity(const string &name, double value) : FinancialEntity(name, value) {}
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void *addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
 
-    void showDetails() const override
+        if (addr == MAP_FAILED)
+        {
+            return false;
+        }
+
+        mapped = static_cast<const char *>(addr);
+        length = static_cast<size_t>(st.st_size);
+        return true;
+    }
+
+    void close()
     {
-        cout << "Equity Name: " << name << "\n"
-             << "Current Value: $" << currentValue << "\n";
+        if (mapped)
+        {
+            munmap(const_cast<char *>(mapped), length);
+            mapped = nullptr;
+            length = 0;
+        }
     }
-    std::string getType() const override { return "Equity"; }
+
+    const char *data() const { return mapped; }
+    size_t size() const { return length; }
 };
 
-// This class just overrides the method getEntityType
-class FinancialManager
+inline bool writeFully(int fd, const char *data, size_t size)
 {
-public:
-    std::string getEntityType(const FinancialEntity &entity) const
+    while (size > 0)
     {
-        return entity.getType();
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0)
+        {
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
     }
-};
+    return true;
+}
 
-// The Transaction class keeps track of all transactions.
-class Transaction
+// Makes a rename or a newly created file in path's directory durable
+inline void syncParentDirectory(const string &path)
 {
-public:
-    string asset;
-    double amount;
-    string type;
-    time_t date;
-
-    Transaction(const string &assetName, double transactionAmount, const string &transactionType)
-        : asset(assetName), amount(transactionAmount), type(transactionType), date(time(nullptr)) {}
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
 
-    static void buy(FinancialEntity &entity, double amount)
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
     {
-        entity.addValue(amount);
-        cout << "Bought $" << amount << " of " << entity.getName() << ".\n";
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
 
+// Replaces the file at path with contents so that a crash leaves either the
+// old file or the new one, never a torn mix: the data goes to path.tmp,
+// which is fsynced and then renamed over path.
+inline bool replaceFile(const string &path, string_view contents)
+{
+    string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
     }
 
-    static void sell(FinancialEntity &entity, double amount)
+    bool written = writeFully(fd, contents.data(), contents.size()) && ::fsync(fd) == 0;
+    if (::close(fd) != 0 || !written || ::rename(temp.c_str(), path.c_str()) != 0)
     {
-        entity.subtractValue(amount);
-        cout << "Sold $" << amount << " of " << entity.getName() << ".\n";
+        ::unlink(temp.c_str());
+        return false;
     }
-};
 
-// Portfolio Manager class
+    syncParentDirectory(path);
+    return true;
+}
 
-class PortfolioManager
+// Position of a parse problem in a CSV file
+struct CsvError
 {
+    size_t line = 0;
+    size_t column = 0;
+    string message;
+};
 
+// Streaming CSV tokenizer. The file is read in large blocks and each record
+// is split into string_views over the block, so parsing allocates nothing
+// per line. Numbers go through from_chars and problems are reported with
+// their line and column instead of being thrown.
+class CsvReader
+{
 private:
-    map<string, unique_ptr<FinancialEntity>> entities;
-
-public:
-    PortfolioManager() = default;
-
-    // disable copy
-    PortfolioManager(const PortfolioManager&) = delete;
-    PortfolioManager& operator=(const PortfolioManager&) = delete;
+    int fd = -1;
+    vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+    size_t lineNumber = 0;
+    string_view currentLine;
+    vector<string_view> fields;
+    CsvError lastError;
+
+    // Moves the unread tail to the front and fills the rest of the buffer
+    bool refill()
+    {
+        if (eof)
+        {
+            return false;
+        }
 
-    // enable move
-    PortfolioManager(PortfolioManager&&) = default;
-    PortfolioManager& operator=(PortfolioManager&&) = default;
+        if (begin > 0)
+        {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
 
-    // Adding an Entity
-    void addEntity(const string &name, double value, const string &type)
-    {
-        if (entities.find(name) != entities.end())
+        if (end == buffer.size())
         {
-            entities[name]->addValue(value);
+            buffer.resize(buffer.size() * 2);
         }
 
-        else
+        ssize_t n = ::read(fd, buffer.data() + end, buffer.size() - end);
+        if (n <= 0)
         {
-            if (type == "Asset")
-            {
-                if (value < 0)
-                {
-                    cout << "Asset value cannot be negative!\n";
-                    cout << "Shall I add in Liability instead? (y/n): ";
+            eof = true;
+            return false;
+        }
 
-                    char choice;
-                    cin >> choice;
+        end += static_cast<size_t>(n);
+        return true;
+    }
 
-                    if (choice == 'y' || choice == 'Y')
-                    {
-                        entities[name] = make_unique<Liability>(name, value);
-                    }
+public:
+    // A path of "-" reads standard input
+    explicit CsvReader(const string &path, size_t bufferSize = 1 << 20) : buffer(bufferSize)
+    {
+        fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    }
 
-                    else
-                    {
-                        entities[name] = make_unique<Asset>(name, -1 * value);
-                    }
-                }
+    CsvReader(const CsvReader &) = delete;
+    CsvReader &operator=(const CsvReader &) = delete;
 
-                else
-                {
-                    entities[name] = make_unique<Asset>(name, value);
-                }
-            }
+    ~CsvReader()
+    {
+        if (fd > STDIN_FILENO)
+        {
+            ::close(fd);
+        }
+    }
 
-            else if (type == "Liability")
-            {
-                if (value > 0)
-                {
-                    cout << "Liability value cannot be positive!\n";
-                    cout << "Shall I add in Asset instead? (y/n): ";
-                    char choice;
-                    cin >> choice;
+    bool isOpen() const { return fd >= 0; }
 
-                    if (choice == 'y' || choice == 'Y')
-                    {
-                        entities[name] = make_unique<Asset>(name, value);
-                    }
+    // Advances to the next non-empty record. Views returned by field() and
+    // line() stay valid until the next call.
+    bool next()
+    {
+        if (fd < 0)
+        {
+            return false;
+        }
 
-                    else
-                    {
-                        entities[name] = make_unique<Liability>(name, -1 * value);
-                    }
-                }
+        while (true)
+        {
+            const char *start = buffer.data() + begin;
+            const char *newline = static_cast<const char *>(memchr(start, '\n', end - begin));
 
-                else
-                {
-                    entities[name] = make_unique<Liability>(name, value);
-                }
+            if (!newline && refill())
+            {
+                continue;
             }
 
-            else if (type == "Equity")
+            if (!newline && begin == end)
             {
-                if (value < 0)
-                {
-                    cout << "Equity value cannot be negative!\n";
-                    cout << "Shall I add in Liability instead? (y/n): ";
-                    char choice;
-                    cin >> choice;
+                return false;
+            }
 
-                    if (choice == 'y' || choice == 'Y')
-                    {
-                        entities[name] = make_unique<Liability>(name, value);
-                    }
+            start = buffer.data() + begin;
+            size_t length = newline ? static_cast<size_t>(newline - start) : end - begin;
+            begin += newline ? length + 1 : length;
+            lineNumber++;
 
-                    else
-                    {
-                        entities[name] = make_unique<Equity>(name, -1 * value);
-                    }
-                }
+            currentLine = string_view(start, length);
+            if (!currentLine.empty() && currentLine.back() == '\r')
+            {
+                currentLine.remove_suffix(1);
+            }
 
-                else
-                {
-                    entities[name] = make_unique<Equity>(name, value);
-                }
+            if (currentLine.empty())
+            {
+                continue;
             }
 
-            else
+            fields.clear();
+            size_t from = 0;
+            while (true)
             {
-                cout << "Invalid financial entity type!\n";
+                size_t comma = currentLine.find(',', from);
+                fields.push_back(currentLine.substr(from, comma == string_view::npos ? string_view::npos : comma - from));
+                if (comma == string_view::npos)
+                {
+                    break;
+                }
+                from = comma + 1;
             }
+            return true;
         }
     }
 
-    const map<string, unique_ptr<FinancialEntity>> &getEntities() const
+    string_view line() const { return currentLine; }
+    size_t fieldCount() const { return fields.size(); }
+    size_t currentLineNumber() const { return lineNumber; }
+
+    string_view field(size_t index) const
     {
-        return entities;
+        return index < fields.size() ? fields[index] : string_view();
     }
 
-    // Function to display Portfolio
-
-    void showPortfolio() const
+    // Parses field index as a double, ignoring surrounding blanks
+    bool number(size_t index, double &value)
     {
-        if (entities.empty())
+        if (index >= fields.size())
         {
-            cout << "No financial entities in the portfolio!\n";
+            return fail(currentLine.size() + 1, "missing field " + to_string(index + 1));
         }
 
-        else
+        string_view text = fields[index];
+        size_t column = static_cast<size_t>(text.data() - currentLine.data()) + 1;
+
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
         {
-            for (const auto &pair : entities)
-            {
-                pair.second->showDetails();
-                cout << "------------------------\n";
-            }
+            text.remove_prefix(1);
+            column++;
         }
-    }
-
-    // Function to search an Entity
-
-    FinancialEntity *searchEntity(const string &name) const
-    {
-        auto it = entities.find(name);
-
-        if (it != entities.end())
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+        {
+            text.remove_suffix(1);
+        }
+        if (!text.empty() && text.front() == '+')
         {
-            return it->second.get();
+            text.remove_prefix(1);
+            column++;
         }
 
-        else
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != errc() || result.ptr != text.data() + text.size())
         {
-            cout << "Entity not found.\n";
-            return nullptr;
+            return fail(column, "invalid number '" + string(fields[index]) + "'");
         }
+        return true;
     }
 
-    // Total value of the Portfolio
-
-    double getTotalValue() const
+    bool fail(size_t column, const string &message)
     {
-        double totalValue = 0;
+        lastError.line = lineNumber;
+        lastError.column = column;
+        lastError.message = message;
+        return false;
+    }
 
-        for (const auto &pair : entities)
-        {
-            totalValue += pair.second->getCurrentValue();
-        }
+    const CsvError &error() const { return lastError; }
+};
 
-        return totalValue;
-    }
+// Appends the shortest text that parses back to the same double
+inline void appendNumber(string &out, double value)
+{
+    char text[32];
+    auto result = to_chars(text, text + sizeof(text), value);
+    out.append(text, result.ptr);
+}
 
-    // Buying an Entity
+inline string csvErrorMessage(const string &path, const CsvError &error)
+{
+    return "Error in " + path + " at line " + to_string(error.line) + ", column " + to_string(error.column) + ": " +
+           error.message;
+}
+
+inline void reportCsvError(const string &path, const CsvError &error)
+{
+    cout << csvErrorMessage(path, error) << "\n";
+}
+
+class FinancialEntity;
+
+// Per-type totals and counts of a portfolio
+struct PortfolioTotals
+{
+    double value[entityTypeCount] = {};
+    size_t count[entityTypeCount] = {};
+
+    double of(EntityType type) const { return value[static_cast<size_t>(type)]; }
+    size_t countOf(EntityType type) const { return count[static_cast<size_t>(type)]; }
 
-    void buyEntity(const string &name, double amount)
+    // Liabilities are held as negative values, so they are added, not
+    // subtracted
+    double netValue() const
     {
-        FinancialEntity *entity = searchEntity(name);
+        return of(EntityType::Asset) + of(EntityType::Equity) + of(EntityType::Liability);
+    }
 
-        if (entity)
+    PortfolioTotals &operator+=(const PortfolioTotals &other)
+    {
+        for (size_t i = 0; i < entityTypeCount; i++)
         {
-            Transaction::buy(*entity, amount);
+            value[i] += other.value[i];
+            count[i] += other.count[i];
         }
+        return *this;
     }
+};
 
-    // Function to Sell an Entity
+// Neumaier's variant of Kahan summation; keeps long-running sums of mixed
+// sign deltas from drifting
+struct CompensatedSum
+{
+    double sum = 0;
+    double compensation = 0;
 
-    void sellEntity(const string &name, double amount)
+    void add(double x)
     {
-        FinancialEntity *entity = searchEntity(name);
-
-        if (entity)
+        double t = sum + x;
+        if (fabs(sum) >= fabs(x))
+        {
+            compensation += (sum - t) + x;
+        }
+        else
         {
-            Transaction::sell(*entity, amount);
+            compensation += (x - t) + sum;
         }
+        sum = t;
     }
-};
 
-// User Class
+    double value() const { return sum + compensation; }
+};
 
-class User
+// Time-indexed history of one value. Each change is stored as a (time,
+// delta) pair and every checkpointInterval-th entry also keeps the absolute
+// value, so an as-of query is a binary search plus at most
+// checkpointInterval additions.
+class ValueHistory
 {
 private:
-    string currentUsername;
-    unordered_map<string, PortfolioManager> userPortfolios;
+    static constexpr size_t checkpointInterval = 64;
+
+    vector<int64_t> times;
+    vector<double> deltas;
+    vector<double> checkpoints;
+    double current = 0;
 
 public:
-    // Check if a user exists in the file
-    bool userExists(const string &username)
+    // Times are expected in order; an earlier time is clamped to the latest
+    void record(int64_t time, double delta)
     {
-        ifstream file("users.txt");
-        string line, savedUsername;
-        while (getline(file, line))
+        if (!times.empty() && time < times.back())
         {
-            stringstream ss(line);
-            getline(ss, savedUsername, ',');
+            time = times.back();
+        }
 
-            if (savedUsername == username)
-            {
-                return true;
-            }
+        current += delta;
+        if (times.size() % checkpointInterval == 0)
+        {
+            checkpoints.push_back(current);
         }
-        return false;
+        times.push_back(time);
+        deltas.push_back(delta);
     }
 
-    // User Registration
-    void registerUser()
+    // Value after every change at or before time
+    double valueAt(int64_t time) const
     {
-        string username, password;
-        cout << "Enter a username: ";
-        cin >> username;
-
-        if (userExists(username))
+        size_t count = upper_bound(times.begin(), times.end(), time) - times.begin();
+        if (count == 0)
         {
-            cout << "Username already exists. Please try again.\n";
-            return;
+            return 0;
         }
 
-        cout << "Enter a password: ";
-        cin >> password;
-
-        // Save new user to the file
-        ofstream file("users.txt", ios::app);
-        if (file.is_open())
-        {
-            file << username << "," << password << "\n";
-            file.close();
-            cout << "User registered successfully!\n";
-        }
+        size_t last = count - 1;
+        size_t checkpoint = last / checkpointInterval;
+        double value = checkpoints[checkpoint];
 
-        else
+        for (size_t i = checkpoint * checkpointInterval + 1; i <= last; i++)
         {
-            cout << "Error: Could not open file for saving.\n";
+            value += deltas[i];
         }
-
-        userPortfolios[username] = PortfolioManager();
+        return value;
     }
 
-    // User Login
-    bool loginUser()
+    // Emits the value at from, then the value after each change in (from, to]
+    void scan(int64_t from, int64_t to, const function<void(int64_t, double)> &emit) const
     {
-        string username, password;
-
-        cout << "Enter username: ";
-        cin >> username;
-
-        cout << "Enter password: ";
-        cin >> password;
-
-        // Check if the username and password match any entry in users.txt
-        ifstream file("users.txt");
-        string line, savedUsername, savedPassword;
+        double value = valueAt(from);
+        emit(from, value);
 
-        while (getline(file, line))
+        size_t i = upper_bound(times.begin(), times.end(), from) - times.begin();
+        for (; i < times.size() && times[i] <= to; i++)
         {
-            stringstream ss(line);
-            getline(ss, savedUsername, ','); // Username
-            getline(ss, savedPassword, ','); // Password
-
-            if (savedUsername == username && savedPassword == password)
-            {
-                currentUsername = username;
-                cout << "Login successful! Welcome, " << username << ".\n";
-                return true;
-            }
+            value += deltas[i];
+            emit(times[i], value);
         }
-
-        // If no match found
-        cout << "Invalid username or password.\n";
-        return false;
     }
 
-    // Returns the username of the currently logged in user
-    string getCurrentUsername() const
-    {
-        return currentUsername;
-    }
+    size_t size() const { return times.size(); }
+};
 
-    // Access the portfolio manager of the logged in user
-    PortfolioManager &getPortfolioManager()
+// Value histories for every entity (by store slot) and for the per-type
+// totals and counts of a portfolio. flows holds the part of each entity's
+// changes that came from adds and trades rather than revaluation.
+struct PortfolioHistory
+{
+    vector<ValueHistory> entities;
+    vector<ValueHistory> flows;
+    ValueHistory typeValue[entityTypeCount];
+    ValueHistory typeCount[entityTypeCount];
+
+    PortfolioTotals totalsAt(int64_t time) const
     {
-        return userPortfolios[currentUsername];
+        PortfolioTotals totals;
+        for (size_t t = 0; t < entityTypeCount; t++)
+        {
+            totals.value[t] = typeValue[t].valueAt(time);
+            totals.count[t] = static_cast<size_t>(typeCount[t].valueAt(time));
+        }
+        return totals;
     }
 };
 
-// FileHandler class handles the portfolio files.
-class FileHandler
+// Market-linked positions: a linked entity holds a quantity of a symbol and
+// is valued at quantity times the symbol's latest price. The position
+// columns are contiguous so a full revaluation is one pass over them, and
+// positionsBySymbol is the reverse index that lets a single price tick
+// re-mark only the positions holding that symbol.
+struct PositionTable
 {
-public:
-    FinancialManager manager;
+    static constexpr uint32_t npos = FlatStringIndex::npos;
 
-    // Function to save the portfolio to a file
+    // Per symbol; prices are NaN until the first one arrives
+    StringPool symbolPool;
+    FlatStringIndex symbolIndex;
+    vector<string_view> symbols;
+    vector<double> prices;
+    vector<vector<uint32_t>> positionsBySymbol;
 
-    void savePortfolio(const PortfolioManager &portfolio, const string &username)
-    {
-        // Considering filename of format username_portfolio.txt
+    // Per position
+    vector<uint32_t> slots;
+    vector<uint32_t> symbolOf;
+    vector<double> quantities;
 
-        string filename = username + "_portfolio.txt";
-        ofstream fio(filename);
+    // Per entity slot: its position, or npos if it is not linked
+    vector<uint32_t> positionOf;
 
-        if (!fio.is_open())
+    uint32_t symbolId(string_view symbol)
+    {
+        uint32_t id = symbolIndex.find(symbol);
+        if (id == npos)
         {
-            std::cout << "Error opening file for saving!\n";
-            return;
+            id = static_cast<uint32_t>(symbols.size());
+            string_view interned = symbolPool.store(symbol);
+            symbolIndex.insert(interned, id);
+            symbols.push_back(interned);
+            prices.push_back(NAN);
+            positionsBySymbol.emplace_back();
         }
+        return id;
+    }
 
-        for (const auto &entityPair : portfolio.getEntities())
+    // Links slot to symbol, moving it out of its old symbol's list if it
+    // was linked before; returns its position
+    uint32_t link(uint32_t slot, uint32_t symbol, double quantity)
+    {
+        uint32_t position = positionOf[slot];
+        if (position == npos)
         {
-            const auto &entity = entityPair.second;
-            fio << entity->getName() << "," << entity->getCurrentValue() << ","
-                << manager.getEntityType(*entity) << "\n";
+            position = static_cast<uint32_t>(slots.size());
+            positionOf[slot] = position;
+            slots.push_back(slot);
+            symbolOf.push_back(symbol);
+            quantities.push_back(quantity);
+            positionsBySymbol[symbol].push_back(position);
+            return position;
         }
 
-        fio.close();
-        std::cout << "Portfolio saved to " << filename << "\n";
+        if (symbolOf[position] != symbol)
+        {
+            vector<uint32_t> &old = positionsBySymbol[symbolOf[position]];
+            old.erase(find(old.begin(), old.end(), position));
+            positionsBySymbol[symbol].push_back(position);
+            symbolOf[position] = symbol;
+        }
+        quantities[position] = quantity;
+        return position;
     }
 
-    // Function to load the portfolio from a file.
-
-    void loadPortfolio(PortfolioManager &portfolio, const std::string &username)
+    // Keeps a position's quantity in line with a value set by a trade
+    void absorb(uint32_t slot, double value)
     {
+        uint32_t position = positionOf[slot];
+        if (position != npos)
+        {
+            double price = prices[symbolOf[position]];
+            if (isfinite(price) && price != 0)
+            {
+                quantities[position] = value / price;
+            }
+        }
+    }
+};
 
-        string filename = username + "_portfolio.txt";
-        ifstream file(filename);
+// Case-insensitive search over entity names. Prefix queries walk a tree of
+// slots kept in name order, as a trie would. Every name is also
+// indexed by its trigrams, with two padding characters in front so that
+// the first letters form anchored trigrams; posting lists hold slots in
+// insertion order and so stay sorted. Substring queries only verify the
+// names found in all of the query's trigram lists. A fuzzy query with k edits verifies the
+// union of the 3k + 1 rarest lists: an edit destroys at most three of the
+// query's trigrams, so any match must appear in one of them.
+class NameSearchIndex
+{
+private:
+    static constexpr unsigned char pad = 1;
 
-        if (!file.is_open())
+    unordered_map<uint32_t, vector<uint32_t>> postings;
+    vector<string_view> names;
+
+    // Name order, ignoring case; ties fall back to the exact bytes and
+    // slot. Also compares a slot with a bare key, for prefix lookups.
+    struct NameOrder
+    {
+        using is_transparent = void;
+        const vector<string_view> *names;
+
+        bool operator()(uint32_t a, uint32_t b) const
         {
-            std::cout << "Error opening file for loading!\n";
-            return;
+            string_view x = (*names)[a], y = (*names)[b];
+            int order = compareFolded(x, y);
+            if (order != 0)
+            {
+                return order < 0;
+            }
+            return x != y ? x < y : a < b;
         }
+        bool operator()(uint32_t a, string_view key) const { return lessFolded((*names)[a], key); }
+        bool operator()(string_view key, uint32_t b) const { return lessFolded(key, (*names)[b]); }
+    };
 
-        std::string line;
+    set<uint32_t, NameOrder> ordered{NameOrder{&names}};
 
-        while (std::getline(file, line))
-        {
-            std::string name, type;
-            double value;
+    // Per-slot query stamps, to visit each candidate once per query
+    vector<uint32_t> seen;
+    uint32_t stamp = 0;
 
-            parseLine(line, name, value, type);
-            portfolio.addEntity(name, value, type);
-        }
+    // ASCII case folding; bytes outside A-Z, UTF-8 included, are unchanged
+    static unsigned char fold(char c)
+    {
+        unsigned char byte = static_cast<unsigned char>(c);
+        return static_cast<unsigned>(byte - 'A') < 26 ? byte + ('a' - 'A') : byte;
+    }
 
-        file.close();
-        cout << "Portfolio loaded from " << filename << "\n";
+    static bool equalsFolded(string_view a, string_view b)
+    {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) { return fold(x) == fold(y); });
     }
 
-private:
-    // Helper function to read a line from the file
-    void parseLine(const std::string &line, std::string &name, double &value, std::string &type)
+    // Negative, zero or positive as a sorts before, with or after b
+    static int compareFolded(string_view a, string_view b)
     {
-        stringstream ss(line);
-        string valueStr;
+        size_t common = min(a.size(), b.size());
+        for (size_t i = 0; i < common; i++)
+        {
+            if (fold(a[i]) != fold(b[i]))
+            {
+                return fold(a[i]) < fold(b[i]) ? -1 : 1;
+            }
+        }
+        return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+    }
 
-        getline(ss, name, ',');
-        getline(ss, valueStr, ',');
+    static bool lessFolded(string_view a, string_view b) { return compareFolded(a, b) < 0; }
 
-        value = stod(valueStr);
-        getline(ss, type, ',');
+    static bool startsFolded(string_view name, string_view text)
+    {
+        return name.size() >= text.size() && equalsFolded(name.substr(0, text.size()), text);
     }
-};
 
+    static size_t findFolded(string_view text, string_view pattern)
+    {
+        auto it = search(text.begin(), text.end(), pattern.begin(), pattern.end(), [](char x, char y) { return fold(x) == fold(y); });
+        return it == text.end() ? string_view::npos : static_cast<size_t>(it - text.begin());
+    }
 
-class PortfolioAnalytics
-{
-public:
-    // Function to calculate total assets value
-    double totalAssets(const PortfolioManager &portfolio) const
+    // Trigram keys of text, anchored at its start or not, sorted and unique
+    static vector<uint32_t> trigrams(string_view text, bool anchored)
     {
-        double total = 0;
-        for (const auto &entityPair : portfolio.getEntities())
+        vector<uint32_t> keys;
+        uint32_t window = anchored ? (pad << 8 | pad) : 0;
+        size_t skip = anchored ? 0 : 2;
+
+        for (size_t i = 0; i < text.size(); i++)
         {
-            if (entityPair.second->getType() == "Asset")
+            window = (window << 8 | fold(text[i])) & 0xFFFFFF;
+            if (i >= skip)
             {
-                total += entityPair.second->getCurrentValue();
+                keys.push_back(window);
             }
         }
-        return total;
+
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        return keys;
     }
 
-    // Function to calculate total liabilities value
-    double totalLiabilities(const PortfolioManager &portfolio) const
+    // Posting lists of keys, shortest first; empty if any key is unknown
+    vector<const vector<uint32_t> *> lists(const vector<uint32_t> &keys, bool requireAll) const
     {
-        double total = 0;
-        for (const auto &entityPair : portfolio.getEntities())
+        vector<const vector<uint32_t> *> found;
+        for (uint32_t key : keys)
         {
-            if (entityPair.second->getType() == "Liability")
+            auto it = postings.find(key);
+            if (it != postings.end())
             {
-                total += entityPair.second->getCurrentValue();
+                found.push_back(&it->second);
+            }
+            else if (requireAll)
+            {
+                return {};
             }
         }
-        return total;
+
+        sort(found.begin(), found.end(), [](const vector<uint32_t> *a, const vector<uint32_t> *b) { return a->size() < b->size(); });
+        return found;
     }
 
-    // Function to calculate total equities value
-    double totalEquities(const PortfolioManager &portfolio) const
+    // Slots in every one of the lists, shortest list first. Each pass
+    // looks the survivors up in the next list with a forward-only galloping
+    // search; once few are left the rest is cheaper to verify directly.
+    static vector<uint32_t> intersect(const vector<const vector<uint32_t> *> &found)
     {
-        double total = 0;
-        for (const auto &entityPair : portfolio.getEntities())
+        vector<uint32_t> survivors(*found.front());
+        for (size_t i = 1; i < found.size() && survivors.size() > 64; i++)
         {
-            if (entityPair.second->getType() == "Equity")
+            auto from = found[i]->begin();
+            auto kept = survivors.begin();
+            for (uint32_t slot : survivors)
             {
-                total += entityPair.second->getCurrentValue();
+                size_t step = 1;
+                while (step < static_cast<size_t>(found[i]->end() - from) && from[step] < slot)
+                {
+                    step *= 2;
+                }
+                from = lower_bound(from, from + min(step + 1, static_cast<size_t>(found[i]->end() - from)), slot);
+                if (from == found[i]->end())
+                {
+                    break;
+                }
+                if (*from == slot)
+                {
+                    *kept++ = slot;
+                }
             }
+            survivors.erase(kept, survivors.end());
         }
-        return total;
+        return survivors;
     }
 
-    // Function to generate a summary report
-    void showReport(const PortfolioManager &portfolio) const
+    // Edit distance between the folded strings if it is at most limit,
+    // otherwise limit + 1; only a band of width 2 * limit + 1 is computed
+    static size_t boundedDistance(string_view a, string_view b, size_t limit)
     {
-        double assets = totalAssets(portfolio);
-        double liabilities = totalLiabilities(portfolio);
-        double equities = totalEquities(portfolio);
-        double netValue = assets + equities - liabilities;
+        if ((a.size() > b.size() ? a.size() - b.size() : b.size() - a.size()) > limit)
+        {
+            return limit + 1;
+        }
 
-        cout << "\n--- Portfolio Summary Report ---\n";
-        cout << "Total Assets: $" << assets << "\n";
-        cout << "Total Liabilities: $" << liabilities << "\n";
-        cout << "Total Equities: $" << equities << "\n";
-        cout << "Net Portfolio Value: $" << netValue << "\n";
-        cout << "---------------------------------\n";
+        const size_t over = limit + 1;
+        vector<size_t> previous(b.size() + 1), current(b.size() + 1);
+        for (size_t j = 0; j <= b.size(); j++)
+        {
+            previous[j] = min(j, over);
+        }
+
+        for (size_t i = 1; i <= a.size(); i++)
+        {
+            size_t from = i > limit ? i - limit : 1;
+            size_t to = min(b.size(), i + limit);
+            size_t best = over;
+
+            current[from - 1] = from == 1 ? min(i, over) : over;
+            for (size_t j = from; j <= to; j++)
+            {
+                size_t cost = fold(a[i - 1]) == fold(b[j - 1]) ? 0 : 1;
+                size_t value = min({previous[j - 1] + cost, previous[j] + 1, current[j - 1] + 1});
+                current[j] = min(value, over);
+                best = min(best, current[j]);
+            }
+            if (to < b.size())
+            {
+                current[to + 1] = over;
+            }
+            if (best > limit)
+            {
+                return over;
+            }
+            swap(previous, current);
+        }
+        return min(previous[b.size()], over);
     }
 
-    // Function to show distribution of entities by type
-    void entityDistribution(const PortfolioManager &portfolio) const
+    // Orders (rank, slot) pairs by rank, then name, and keeps the first limit
+    vector<uint32_t> ranked(vector<pair<size_t, uint32_t>> &matches, size_t limit) const
     {
-        map<string, int> distribution;
+        auto better = [this](const pair<size_t, uint32_t> &a, const pair<size_t, uint32_t> &b) {
+            return a.first != b.first ? a.first < b.first : names[a.second] < names[b.second];
+        };
 
-        for (const auto &entityPair : portfolio.getEntities())
-        {
-            string type = entityPair.second->getType();
-            distribution[type]++;
-        }
+        limit = min(limit, matches.size());
+        partial_sort(matches.begin(), matches.begin() + limit, matches.end(), better);
 
-        cout << "\n--- Portfolio Entity Distribution ---\n";
-        for (const auto &entry : distribution)
+        vector<uint32_t> slots;
+        slots.reserve(limit);
+        for (size_t i = 0; i < limit; i++)
         {
-            cout << entry.first << ": " << entry.second << "\n";
+            slots.push_back(matches[i].second);
         }
-        cout << "------------------------------------\n";
+        return slots;
     }
-};
 
-class Watchlist {
 public:
+    NameSearchIndex() = default;
 
-    void add_asset(const string &username, const string &asset_name, double initial_price) {
-        ofstream file(username + "_watchlist.txt", ios::app);
-        if (!file.is_open()) {
-            cout << "Error opening watchlist file!\n";
-            return;
-        }
-
-        file << asset_name << "," << initial_price << "," << initial_price << "\n";
-        file.close();
-        cout << "Added " << asset_name << " to the watchlist.\n";
-    }
+    // ordered refers to names, so the index stays where it was built
+    NameSearchIndex(const NameSearchIndex&) = delete;
+    NameSearchIndex& operator=(const NameSearchIndex&) = delete;
 
-    void remove_asset(const string &username, const string &asset_name) {
-        ifstream infile(username + "_watchlist.txt");
-        ofstream tempFile("temp.txt");
+    void add(uint32_t slot, string_view name)
+    {
+        names.push_back(name);
+        seen.push_back(0);
+        ordered.insert(slot);
 
-        if (!infile.is_open() || !tempFile.is_open()) {
-            cout << "Error opening files for removing asset!\n";
-            return;
+        for (uint32_t key : trigrams(name, true))
+        {
+            postings[key].push_back(slot);
         }
+    }
 
-        string line;
-        bool asset_found = false;
-        while (getline(infile, line)) {
-            stringstream ss(line);
-            string name;
-            getline(ss, name, ',');
-            if (name != asset_name) {
-                tempFile << line << "\n";
-            } else {
-                asset_found = true;
+    // Indexes all of names at once, which must be the first thing added
+    void addAll(const vector<string_view> &all)
+    {
+        // Sort keys carry each name's first eight folded bytes, so most
+        // comparisons never reach the names themselves
+        vector<pair<uint64_t, uint32_t>> keys(all.size());
+        for (uint32_t slot = 0; slot < all.size(); slot++)
+        {
+            uint64_t head = 0;
+            for (size_t i = 0; i < 8; i++)
+            {
+                head = head << 8 | (i < all[slot].size() ? fold(all[slot][i]) : 0);
+            }
+            keys[slot] = {head, slot};
+            names.push_back(all[slot]);
+            seen.push_back(0);
+
+            for (uint32_t key : trigrams(all[slot], true))
+            {
+                postings[key].push_back(slot);
             }
         }
 
-        infile.close();
-        tempFile.close();
-        remove((username + "_watchlist.txt").c_str());
-        rename("temp.txt", (username + "_watchlist.txt").c_str());
+        NameOrder order = ordered.key_comp();
+        sort(keys.begin(), keys.end(), [&order](const pair<uint64_t, uint32_t> &a, const pair<uint64_t, uint32_t> &b) {
+            return a.first != b.first ? a.first < b.first : order(a.second, b.second);
+        });
 
-        if (asset_found) {
-            cout << "Removed " << asset_name << " from the watchlist.\n";
-        } else {
-            cout << "Asset " << asset_name << " not found in the watchlist.\n";
+        // Sorted input makes every tree insertion an append
+        for (const auto &key : keys)
+        {
+            ordered.insert(ordered.end(), key.second);
         }
     }
 
-    void track_performance(const string &username) const {
-        ifstream file(username + "_watchlist.txt");
-        if (!file.is_open()) {
-            cout << "Error opening watchlist file for tracking performance!\n";
-            return;
+    // Names starting with text in name order, so an exact match comes first
+    vector<uint32_t> prefix(string_view text, size_t limit)
+    {
+        vector<uint32_t> matches;
+        if (text.empty())
+        {
+            return matches;
         }
 
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string name;
-            double initial_price, current_price;
-            getline(ss, name, ',');
-            ss >> initial_price;
-            ss.ignore(1, ',');
-            ss >> current_price;
-
-            double change = ((current_price - initial_price) / initial_price) * 100;
-            cout << "Asset: " << name << ", Price Change: " << change << "%\n";
+        for (auto it = ordered.lower_bound(text); it != ordered.end() && matches.size() < limit && startsFolded(names[*it], text); ++it)
+        {
+            matches.push_back(*it);
         }
-        file.close();
+        return matches;
     }
 
-    void notify_significant_changes(const string &username, double threshold) const {
-        ifstream file(username + "_watchlist.txt");
-        if (!file.is_open()) {
-            cout << "Error opening watchlist file for notifications!\n";
-            return;
+    // Names containing text, earliest occurrence first. Text shorter than a
+    // trigram has no list to narrow the search and scans every name.
+    vector<uint32_t> substring(string_view text, size_t limit)
+    {
+        vector<pair<size_t, uint32_t>> matches;
+        if (text.empty())
+        {
+            return {};
         }
 
-        string line;
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string name;
-            double initial_price, current_price;
-            getline(ss, name, ',');
-            ss >> initial_price;
-            ss.ignore(1, ',');
-            ss >> current_price;
+        auto check = [&](uint32_t slot) {
+            size_t at = findFolded(names[slot], text);
+            if (at != string_view::npos)
+            {
+                matches.emplace_back(at, slot);
+            }
+        };
 
-            double change = ((current_price - initial_price) / initial_price) * 100;
-            if (abs(change) >= threshold) {
-                cout << "Significant change in " << name << ": " << change << "%\n";
+        if (text.size() < 3)
+        {
+            for (uint32_t slot = 0; slot < names.size(); slot++)
+            {
+                check(slot);
             }
         }
-        file.close();
-    }
-
-    void update_price(const string &username, const string &asset_name, double new_price) {
-        ifstream infile(username + "_watchlist.txt");
-        ofstream tempFile("temp.txt");
-
-        if (!infile.is_open() || !tempFile.is_open()) {
-            cout << "Error opening files for updating price!\n";
-            return;
+        else
+        {
+            vector<const vector<uint32_t> *> found = lists(trigrams(text, false), true);
+            if (!found.empty())
+            {
+                for (uint32_t slot : intersect(found))
+                {
+                    check(slot);
+                }
+            }
         }
+        return ranked(matches, limit);
+    }
 
-        string line;
-        bool asset_found = false;
-        while (getline(infile, line)) {
-            stringstream ss(line);
-            string name;
-            double initial_price, current_price;
-            getline(ss, name, ',');
-            ss >> initial_price;
-            ss.ignore(1, ',');
-            ss >> current_price;
+    // Names within maxEdits edits of text, closest first. With too few
+    // trigrams to rule names out (text length <= 3 * maxEdits) every name
+    // is checked.
+    vector<uint32_t> fuzzy(string_view text, size_t maxEdits, size_t limit)
+    {
+        vector<pair<size_t, uint32_t>> matches;
+        auto check = [&](uint32_t slot) {
+            size_t distance = boundedDistance(text, names[slot], maxEdits);
+            if (distance <= maxEdits)
+            {
+                matches.emplace_back(distance, slot);
+            }
+        };
 
-            if (name == asset_name) {
-                current_price = new_price;
-                asset_found = true;
+        vector<uint32_t> keys = trigrams(text, true);
+        if (keys.size() <= 3 * maxEdits)
+        {
+            for (uint32_t slot = 0; slot < names.size(); slot++)
+            {
+                check(slot);
             }
-            tempFile << name << "," << initial_price << "," << current_price << "\n";
+            return ranked(matches, limit);
         }
 
-        infile.close();
-        tempFile.close();
-        remove((username + "_watchlist.txt").c_str());
-        rename("temp.txt", (username + "_watchlist.txt").c_str());
+        // Any match keeps at least keys.size() - 3 * maxEdits of the keys,
+        // so it is in one of the 3 * maxEdits + 1 rarest lists
+        vector<const vector<uint32_t> *> found = lists(keys, false);
+        size_t needed = 3 * maxEdits + 1;
+        size_t missing = keys.size() - found.size();
 
-        if (asset_found) {
-            cout << "Updated price of " << asset_name << " to " << new_price << ".\n";
-        } else {
-            cout << "Asset " << asset_name << " not found in the watchlist.\n";
+        if (missing < needed)
+        {
+            stamp++;
+            for (size_t i = 0; i < needed - missing; i++)
+            {
+                for (uint32_t slot : *found[i])
+                {
+                    if (seen[slot] != stamp)
+                    {
+                        seen[slot] = stamp;
+                        check(slot);
+                    }
+                }
+            }
         }
+        return ranked(matches, limit);
     }
 };
 
-// Consider moving methods to classes for separation of concerns
-// NOTE: You also have duplicate methods, only keep one
+// Entities of one type ordered by (value, slot). Keys sit in sorted blocks
+// of up to 2 * blockSize entries, and a Fenwick tree over the block sizes
+// maps a rank to its block, so the entry at any rank is found in O(log n)
+// and a sorted page or a top-K list costs O(log n + k). Inserts and erases
+// move at most a few blocks' worth of keys. A block that erases leave with
+// fewer than blockSize / 4 keys is merged into a neighbour, so the number
+// of blocks stays within a small multiple of size() / blockSize. NaN
+// values have no place in the order and are rejected.
+class ValueOrder
+{
+public:
+    using Key = pair<double, uint32_t>;
 
-void addEntity() {
-    PortfolioManager portfolio;
-    string name, type;
-    double value;
+private:
+    static constexpr size_t blockSize = 512;
 
-    cout << "Enter entity name: ";
-    cin >> name;
+    vector<vector<Key>> blocks;
+    vector<size_t> counts; // Fenwick tree over block sizes, 1-based
+    size_t total = 0;
 
-    cout << "Enter entity type (Asset/Liability/Equity): ";
-    cin >> type;
+    void rebuildCounts()
+    {
+        counts.assign(blocks.size() + 1, 0);
+        for (size_t i = 1; i <= blocks.size(); i++)
+        {
+            counts[i] += blocks[i - 1].size();
+            size_t parent = i + (i & (~i + 1));
+            if (parent <= blocks.size())
+            {
+                counts[parent] += counts[i];
+            }
+        }
+    }
 
-    cout << "Enter entity value: ";
-    cin >> value;
+    void addCount(size_t block, ptrdiff_t delta)
+    {
+        for (size_t i = block + 1; i < counts.size(); i += i & (~i + 1))
+        {
+            counts[i] += delta;
+        }
+    }
 
-    portfolio.addEntity(name, value, type);
-}
+    // Merges block b, which has run low, with a neighbour, splitting the
+    // result again if it is too large
+    void mergeBlock(size_t b)
+    {
+        size_t low = b + 1 < blocks.size() ? b : b - 1;
+        vector<Key> &merged = blocks[low];
+        vector<Key> &next = blocks[low + 1];
+        merged.insert(merged.end(), next.begin(), next.end());
+        blocks.erase(blocks.begin() + low + 1);
 
-void buyEntity() {
-    PortfolioManager portfolio;
+        if (blocks[low].size() > 2 * blockSize)
+        {
+            vector<Key> &block = blocks[low];
+            size_t half = block.size() / 2;
+            vector<Key> upper(block.begin() + half, block.end());
+            block.resize(half);
+            blocks.insert(blocks.begin() + low + 1, std::move(upper));
+        }
+    }
+
+    // First block whose last key is not below key, or the last block.
+    // Needs a block.
+    size_t blockFor(const Key &key) const
+    {
+        size_t low = 0, high = blocks.size() - 1;
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (blocks[mid].back() < key)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+public:
+    class const_iterator
+    {
+    private:
+        const ValueOrder *order;
+        size_t block;
+        size_t index;
+
+    public:
+        using iterator_category = bidirectional_iterator_tag;
+        using value_type = Key;
+        using difference_type = ptrdiff_t;
+        using pointer = const Key *;
+        using reference = const Key &;
+
+        const_iterator(const ValueOrder *order, size_t block, size_t index) : order(order), block(block), index(index) {}
+
+        const Key &operator*() const { return order->blocks[block][index]; }
+        const Key *operator->() const { return &order->blocks[block][index]; }
+
+        const_iterator &operator++()
+        {
+            if (++index == order->blocks[block].size())
+            {
+                block++;
+                index = 0;
+            }
+            return *this;
+        }
+
+        const_iterator &operator--()
+        {
+            if (index == 0)
+            {
+                index = order->blocks[--block].size();
+            }
+            index--;
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const { return block == other.block && index == other.index; }
+        bool operator!=(const const_iterator &other) const { return !(*this == other); }
+    };
+
+    size_t size() const { return total; }
+
+    size_t blockCount() const { return blocks.size(); }
+
+    const_iterator begin() const { return const_iterator(this, 0, 0); }
+    const_iterator end() const { return const_iterator(this, blocks.size(), 0); }
+
+    // Replaces the contents with keys, which must be sorted and distinct.
+    // Throws invalid_argument, leaving the contents alone, for a NaN value.
+    void assign(const vector<Key> &keys)
+    {
+        if (any_of(keys.begin(), keys.end(), [](const Key &key) { return isnan(key.first); }))
+        {
+            throw invalid_argument("NaN value in a value order");
+        }
+
+        blocks.clear();
+        for (size_t i = 0; i < keys.size(); i += blockSize)
+        {
+            blocks.emplace_back(keys.begin() + i, keys.begin() + min(keys.size(), i + blockSize));
+        }
+        total = keys.size();
+        rebuildCounts();
+    }
+
+    // Throws invalid_argument, leaving the contents alone, for a NaN value
+    void insert(const Key &key)
+    {
+        if (isnan(key.first))
+        {
+            throw invalid_argument("NaN value in a value order");
+        }
+
+        if (blocks.empty())
+        {
+            blocks.push_back({key});
+            total = 1;
+            rebuildCounts();
+            return;
+        }
+
+        size_t b = blockFor(key);
+        vector<Key> &block = blocks[b];
+        block.insert(std::lower_bound(block.begin(), block.end(), key), key);
+        total++;
+
+        if (block.size() > 2 * blockSize)
+        {
+            vector<Key> upper(block.begin() + blockSize, block.end());
+            block.resize(blockSize);
+            blocks.insert(blocks.begin() + b + 1, std::move(upper));
+            rebuildCounts();
+        }
+        else
+        {
+            addCount(b, 1);
+        }
+    }
+
+    // Returns the number of keys removed, 0 or 1
+    size_t erase(const Key &key)
+    {
+        if (blocks.empty() || isnan(key.first))
+        {
+            return 0;
+        }
+
+        size_t b = blockFor(key);
+        vector<Key> &block = blocks[b];
+        auto it = std::lower_bound(block.begin(), block.end(), key);
+        if (it == block.end() || *it != key)
+        {
+            return 0;
+        }
+
+        block.erase(it);
+        total--;
+        if (total == 0)
+        {
+            blocks.clear();
+            rebuildCounts();
+        }
+        else if (block.size() < blockSize / 4 && blocks.size() > 1)
+        {
+            mergeBlock(b);
+            rebuildCounts();
+        }
+        else
+        {
+            addCount(b, -1);
+        }
+        return 1;
+    }
+
+    // The key at rank (0 for the smallest), or end()
+    const_iterator find_by_order(size_t rank) const
+    {
+        if (rank >= total)
+        {
+            return end();
+        }
+
+        size_t position = 0;
+        size_t step = 1;
+        while (step * 2 < counts.size())
+        {
+            step *= 2;
+        }
+        for (; step > 0; step /= 2)
+        {
+            if (position + step < counts.size() && counts[position + step] <= rank)
+            {
+                position += step;
+                rank -= counts[position];
+            }
+        }
+        return const_iterator(this, position, rank);
+    }
+
+    // The first key not below key, or end()
+    const_iterator lower_bound(const Key &key) const
+    {
+        if (blocks.empty() || isnan(key.first))
+        {
+            return end();
+        }
+
+        size_t b = blockFor(key);
+        const vector<Key> &block = blocks[b];
+        size_t index = std::lower_bound(block.begin(), block.end(), key) - block.begin();
+        return index == block.size() ? const_iterator(this, b + 1, 0) : const_iterator(this, b, index);
+    }
+};
+
+// EntityStore is the columnar side of a portfolio: values and type tags in
+// contiguous arrays, names interned in a pool and a name -> slot hash index.
+// Aggregations scan these arrays instead of walking the entity objects.
+class EntityStore
+{
+private:
+    vector<double> values;
+    vector<EntityType> types;
+    vector<string_view> names;
+    vector<FinancialEntity *> objects;
+    StringPool namePool;
+    FlatStringIndex nameIndex;
+
+    // Running per-type totals, updated in O(1) on every mutation
+    CompensatedSum runningValue[entityTypeCount];
+    size_t runningCount[entityTypeCount] = {};
+
+    // Present only when history tracking is enabled
+    unique_ptr<PortfolioHistory> history;
+    int64_t eventTime = 0;
+
+    // Present only when revaluation is enabled
+    unique_ptr<PositionTable> positions;
+
+    // Per-type value order; present once a sorted view has been asked for
+    unique_ptr<ValueOrder[]> valueOrder;
+
+    // Name search index; present once a search has been run
+    unique_ptr<NameSearchIndex> nameSearch;
+
+    // Slots added or changed since the last clearDirty, each listed once
+    vector<uint32_t> dirtySlots;
+    vector<bool> dirtyFlags;
+
+    void markDirty(uint32_t slot)
+    {
+        if (!dirtyFlags[slot])
+        {
+            dirtyFlags[slot] = true;
+            dirtySlots.push_back(slot);
+        }
+    }
+
+    void applyDelta(EntityType type, double delta)
+    {
+        runningValue[static_cast<size_t>(type)].add(delta);
+#ifdef PMS_DEBUG_TOTALS
+        checkTotals();
+#endif
+    }
+
+    void recordHistory(uint32_t slot, EntityType type, double delta, double countDelta, bool trade)
+    {
+        int64_t time = eventTime ? eventTime : static_cast<int64_t>(::time(nullptr));
+        size_t t = static_cast<size_t>(type);
+
+        history->entities[slot].record(time, delta);
+        if (trade)
+        {
+            history->flows[slot].record(time, delta);
+        }
+        history->typeValue[t].record(time, delta);
+        if (countDelta != 0)
+        {
+            history->typeCount[t].record(time, countDelta);
+        }
+    }
+
+    // A trade's change is also recorded as a flow in the history
+    void assignValue(uint32_t slot, double value, bool trade)
+    {
+        if (valueOrder && value != values[slot])
+        {
+            // Inserting first leaves the store as it was if value is rejected
+            ValueOrder &order = valueOrder[static_cast<size_t>(types[slot])];
+            order.insert({value, slot});
+            order.erase({values[slot], slot});
+        }
+
+        double delta = value - values[slot];
+        values[slot] = value;
+        applyDelta(types[slot], delta);
+        markDirty(slot);
+
+        if (history)
+        {
+            recordHistory(slot, types[slot], delta, 0, trade);
+        }
+    }
+
+public:
+    static constexpr uint32_t npos = FlatStringIndex::npos;
+
+    uint32_t find(string_view name) const { return nameIndex.find(name); }
+
+    uint32_t append(string_view name, double value, EntityType type, FinancialEntity *object)
+    {
+        uint32_t slot = static_cast<uint32_t>(values.size());
+        if (valueOrder)
+        {
+            valueOrder[static_cast<size_t>(type)].insert({value, slot});
+        }
+
+        string_view interned = namePool.store(name);
+
+        values.push_back(value);
+        types.push_back(type);
+        names.push_back(interned);
+        objects.push_back(object);
+        nameIndex.insert(interned, slot);
+        runningCount[static_cast<size_t>(type)]++;
+        applyDelta(type, value);
+        dirtyFlags.push_back(false);
+        markDirty(slot);
+
+        if (positions)
+        {
+            positions->positionOf.push_back(PositionTable::npos);
+        }
+
+        if (nameSearch)
+        {
+            nameSearch->add(slot, interned);
+        }
+
+        if (history)
+        {
+            history->entities.emplace_back();
+            history->flows.emplace_back();
+            recordHistory(slot, type, value, 1, true);
+        }
+        return slot;
+    }
+
+    void setObject(uint32_t slot, FinancialEntity *object) { objects[slot] = object; }
+
+    void setValue(uint32_t slot, double value)
+    {
+        assignValue(slot, value, true);
+
+        if (positions)
+        {
+            positions->absorb(slot, value);
+        }
+    }
+
+    // Sets a value that came from revaluation, leaving the position's
+    // quantity as it is
+    void markValue(uint32_t slot, double value)
+    {
+        assignValue(slot, value, false);
+    }
+
+    void enablePositions()
+    {
+        if (!positions)
+        {
+            positions = make_unique<PositionTable>();
+            positions->positionOf.assign(values.size(), PositionTable::npos);
+        }
+    }
+
+    PositionTable *getPositions() const { return positions.get(); }
+
+    // Builds the per-type value order; kept up to date from then on.
+    // Throws invalid_argument, leaving the order off, if a value is NaN.
+    void enableValueOrder()
+    {
+        if (!valueOrder)
+        {
+            if (any_of(values.begin(), values.end(), [](double value) { return isnan(value); }))
+            {
+                throw invalid_argument("NaN value in a value order");
+            }
+            valueOrder = make_unique<ValueOrder[]>(entityTypeCount);
+
+            // Sort once and fill each type's blocks in order
+            vector<ValueOrder::Key> keys(values.size());
+            for (uint32_t slot = 0; slot < values.size(); slot++)
+            {
+                keys[slot] = {values[slot], slot};
+            }
+            sort(keys.begin(), keys.end());
+
+            vector<ValueOrder::Key> byType[entityTypeCount];
+            for (const auto &key : keys)
+            {
+                byType[static_cast<size_t>(types[key.second])].push_back(key);
+            }
+            for (size_t t = 0; t < entityTypeCount; t++)
+            {
+                valueOrder[t].assign(byType[t]);
+            }
+        }
+    }
+
+    const ValueOrder *getValueOrder(EntityType type) const
+    {
+        return valueOrder ? &valueOrder[static_cast<size_t>(type)] : nullptr;
+    }
+
+    // Builds the name search index; kept up to date from then on
+    NameSearchIndex &enableNameSearch()
+    {
+        if (!nameSearch)
+        {
+            nameSearch = make_unique<NameSearchIndex>();
+            nameSearch->addAll(names);
+        }
+        return *nameSearch;
+    }
+
+    // Starts keeping value histories. Entities already held are recorded
+    // as added now, at their current values, so as-of queries from here on
+    // include them; earlier changes are not covered.
+    void enableHistory()
+    {
+        if (!history)
+        {
+            history = make_unique<PortfolioHistory>();
+            history->entities.resize(values.size());
+            history->flows.resize(values.size());
+
+            for (uint32_t slot = 0; slot < values.size(); slot++)
+            {
+                recordHistory(slot, types[slot], values[slot], 1, true);
+            }
+        }
+    }
+
+    const PortfolioHistory *getHistory() const { return history.get(); }
+
+    const vector<uint32_t> &dirty() const { return dirtySlots; }
+
+    void clearDirty()
+    {
+        for (uint32_t slot : dirtySlots)
+        {
+            dirtyFlags[slot] = false;
+        }
+        dirtySlots.clear();
+    }
+
+    // Time stamped on history entries; 0 means the current time. Set while
+    // replaying transactions that carry their own dates.
+    void setEventTime(int64_t time) { eventTime = time; }
+
+    PortfolioTotals totals() const
+    {
+        PortfolioTotals result;
+        for (size_t t = 0; t < entityTypeCount; t++)
+        {
+            result.value[t] = runningValue[t].value();
+            result.count[t] = runningCount[t];
+        }
+        return result;
+    }
+
+    // Full compensated rescan of the value column
+    PortfolioTotals rescan() const
+    {
+        CompensatedSum sums[entityTypeCount];
+        PortfolioTotals result;
+
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            size_t t = static_cast<size_t>(types[i]);
+            sums[t].add(values[i]);
+            result.count[t]++;
+        }
+
+        for (size_t t = 0; t < entityTypeCount; t++)
+        {
+            result.value[t] = sums[t].value();
+        }
+        return result;
+    }
+
+    // Cross-checks the running totals against a rescan; throws on drift
+    // beyond what rounding of the summed magnitudes can explain
+    void checkTotals() const
+    {
+        PortfolioTotals expected = rescan();
+        PortfolioTotals running = totals();
+        double magnitude = 0;
+
+        for (double v : values)
+        {
+            magnitude += fabs(v);
+        }
+
+        for (size_t t = 0; t < entityTypeCount; t++)
+        {
+            double drift = fabs(expected.value[t] - running.value[t]);
+            if (drift > 1e-9 * magnitude + 1e-9 || expected.count[t] != running.count[t])
+            {
+                throw logic_error(string("Running total drifted for ") +
+                                  entityTypeName(static_cast<EntityType>(t)));
+            }
+        }
+    }
+
+    void reserve(size_t n)
+    {
+        values.reserve(n);
+        types.reserve(n);
+        names.reserve(n);
+        objects.reserve(n);
+        dirtyFlags.reserve(n);
+        nameIndex.reserve(n);
+    }
+
+    size_t size() const { return values.size(); }
+    const double *valueData() const { return values.data(); }
+    const EntityType *typeData() const { return types.data(); }
+    string_view nameAt(uint32_t slot) const { return names[slot]; }
+    FinancialEntity *objectAt(uint32_t slot) const { return objects[slot]; }
+};
+
+// Entities do not own their names: name must outlive the entity. Entities
+// created by a PortfolioManager point at its interned name table.
+class FinancialEntity
+{
+protected:
+    string_view name;
+    double currentValue;
+    EntityType typeTag;
+
+private:
+    // Set once the entity is owned by a portfolio's EntityStore
+    EntityStore *store = nullptr;
+    uint32_t slot = 0;
+
+    void publishValue()
+    {
+        if (store)
+        {
+            store->setValue(slot, currentValue);
+        }
+    }
+
+    friend class PortfolioManager;
+
+public:
+    FinancialEntity(string_view name, double value, EntityType type) : name(name), currentValue(value), typeTag(type) {}
+
+    // Writes the entity's details to out (the console by default)
+    virtual void showDetails(ostream &out = cout) const = 0;
+
+    // Non-virtual, allocation-free accessors; the type is answered from the
+    // tag, and visitEntity reaches the concrete class
+    EntityType getTypeTag() const { return typeTag; }
+    string_view getNameView() const { return name; }
+    string_view getTypeName() const { return entityTypeName(typeTag); }
+    double getValue() const { return currentValue; }
+
+    void setValue(double newValue)
+    {
+        currentValue = newValue;
+        publishValue();
+    }
+
+    void addValue(double value)
+    {
+        currentValue += value;
+        publishValue();
+    }
+
+    bool subtractValue(double value)
+    {
+        if (value <= currentValue)
+        {
+            currentValue -= value;
+            publishValue();
+            return true;
+        }
+
+        else
+        {
+            return false;
+        }
+    }
+    virtual ~FinancialEntity() = default;
+};
+
+// Asset Class
+
+class Asset final : public FinancialEntity
+{
+public:
+    static constexpr EntityType tag = EntityType::Asset;
+
+    Asset(string_view name, double value) : FinancialEntity(name, value, tag) {}
+
+    void showDetails(ostream &out = cout) const override
+    {
+        out << "Asset Name: " << name << "\n"
+             << "Current Value: $" << currentValue << "\n";
+    }
+};
+
+// Liability Class
+
+class Liability final : public FinancialEntity
+{
+public:
+    static constexpr EntityType tag = EntityType::Liability;
+
+    Liability(string_view name, double value) : FinancialEntity(name, value, tag) {}
+
+    void showDetails(ostream &out = cout) const override
+    {
+        out << "Liability Name: " << name << "\n"
+             << "Current Value: $" << currentValue << "\n";
+    }
+};
+
+// Equity Class
+
+class Equity final : public FinancialEntity
+{
+public:
+    static constexpr EntityType tag = EntityType::Equity;
+
+    Equity(string_view name, double value) : FinancialEntity(name, value, tag) {}
+
+    void showDetails(ostream &out = cout) const override
+    {
+        out << "Equity Name: " << name << "\n"
+             << "Current Value: $" << currentValue << "\n";
+    }
+};
+
+// Calls visitor with the entity as its concrete class, chosen by switching
+// on the type tag. The classes are final, so calls made through the
+// concrete type are resolved at compile time instead of through the vtable.
+template <class Entity, class Visitor>
+decltype(auto) visitEntity(Entity &entity, Visitor &&visitor)
+{
+    using Base = remove_const_t<Entity>;
+    static_assert(is_same_v<Base, FinancialEntity>, "visitEntity takes a FinancialEntity");
+
+    switch (entity.getTypeTag())
+    {
+        case EntityType::Liability:
+            return visitor(static_cast<conditional_t<is_const_v<Entity>, const Liability, Liability> &>(entity));
+        case EntityType::Equity:
+            return visitor(static_cast<conditional_t<is_const_v<Entity>, const Equity, Equity> &>(entity));
+        case EntityType::Asset:
+        default:
+            return visitor(static_cast<conditional_t<is_const_v<Entity>, const Asset, Asset> &>(entity));
+    }
+}
+
+// Counts the blocks an arena draws from the heap
+class CountingResource : public pmr::memory_resource
+{
+private:
+    size_t allocations = 0;
+    size_t bytes = 0;
+
+protected:
+    void *do_allocate(size_t size, size_t alignment) override
+    {
+        allocations++;
+        bytes += size;
+        return pmr::new_delete_resource()->allocate(size, alignment);
+    }
+
+    void do_deallocate(void *pointer, size_t size, size_t alignment) override
+    {
+        pmr::new_delete_resource()->deallocate(pointer, size, alignment);
+    }
+
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+public:
+    size_t allocationCount() const { return allocations; }
+    size_t allocatedBytes() const { return bytes; }
+};
+
+// Entities live in an arena: the deleter only runs the destructor and the
+// memory is released with the arena
+struct ArenaDelete
+{
+    void operator()(FinancialEntity *entity) const { entity->~FinancialEntity(); }
+};
+
+using EntityPtr = unique_ptr<FinancialEntity, ArenaDelete>;
+using EntityMap = pmr::map<string_view, EntityPtr>;
+
+struct AllocationStats
+{
+    size_t entities = 0;
+    size_t heapAllocations = 0;
+    size_t heapBytes = 0;
+};
+
+// Everything a portfolio allocates per entity: the objects and the name map
+// nodes are bump-allocated from one arena (keys are views of the interned
+// names in the store), so building a portfolio costs a handful of heap
+// blocks and teardown frees them in bulk.
+struct EntityStorage
+{
+    CountingResource upstream;
+    pmr::monotonic_buffer_resource arena{64 * 1024, &upstream};
+    EntityStore store;
+    EntityMap entities{&arena};
+
+    template <class T>
+    T *create(string_view name, double value)
+    {
+        void *memory = arena.allocate(sizeof(T), alignof(T));
+        return new (memory) T(name, value);
+    }
+};
+
+// Names an entity's type (Asset, Liability, Equity) from its tag
+class FinancialManager
+{
+public:
+    std::string getEntityType(const FinancialEntity &entity) const
+    {
+        return string(entity.getTypeName());
+    }
+
+    // Same as getEntityType without the allocation
+    string_view getEntityTypeName(const FinancialEntity &entity) const
+    {
+        return entity.getTypeName();
+    }
+};
+
+// The Transaction class keeps track of all transactions.
+class Transaction
+{
+public:
+    string asset;
+    double amount;
+    string type;
+    time_t date;
+
+    Transaction(const string &assetName, double transactionAmount, const string &transactionType)
+        : asset(assetName), amount(transactionAmount), type(transactionType), date(time(nullptr)) {}
+
+    static void buy(FinancialEntity &entity, double amount)
+    {
+        entity.addValue(amount);
+    }
+
+    static bool sell(FinancialEntity &entity, double amount)
+    {
+        return entity.subtractValue(amount);
+    }
+};
+
+// TransactionLedger is an append-only file of fixed 64-byte records, one per
+// add, buy, sell or mark to market (username_ledger.bin). Appends go to an in-memory batch;
+// a committer thread writes and fdatasyncs the batch every commit interval,
+// or sooner once it fills, so many transactions share one sync (group
+// commit). With a zero interval no thread is started and the owner calls
+// commit() itself. Names longer than one record carries are split across NamePart
+// records that precede the transaction record.
+class TransactionLedger
+{
+public:
+    enum class Kind : uint8_t
+    {
+        Add,
+        Buy,
+        Sell,
+        NamePart,
+        // A revalued position; amount is its new value, not a change
+        Mark
+    };
+
+private:
+    static constexpr size_t nameCapacity = 45;
+
+    struct Record
+    {
+        int64_t date;
+        double amount;
+        uint8_t kind;
+        uint8_t entityType;
+        uint8_t nameLength;
+        char name[nameCapacity];
+    };
+
+    static_assert(sizeof(Record) == 64, "ledger record layout");
+
+    int fd = -1;
+    vector<Record> pending;
+    vector<Record> writing;
+    size_t batchSize;
+    chrono::milliseconds commitInterval;
+    mutex lock;
+    mutex commitLock;
+    condition_variable wake;
+    bool stopping = false;
+    thread committer;
+
+    static Record makeRecord(int64_t date, double amount, Kind kind, EntityType type, string_view name)
+    {
+        Record record;
+        memset(&record, 0, sizeof(record));
+        record.date = date;
+        record.amount = amount;
+        record.kind = static_cast<uint8_t>(kind);
+        record.entityType = static_cast<uint8_t>(type);
+        record.nameLength = static_cast<uint8_t>(name.size());
+        memcpy(record.name, name.data(), name.size());
+        return record;
+    }
+
+    static bool kindFromType(const string &type, Kind &kind)
+    {
+        if (type == "Add") { kind = Kind::Add; return true; }
+        if (type == "Buy") { kind = Kind::Buy; return true; }
+        if (type == "Sell") { kind = Kind::Sell; return true; }
+        if (type == "Mark") { kind = Kind::Mark; return true; }
+        return false;
+    }
+
+    void runCommitter()
+    {
+        unique_lock<mutex> guard(lock);
+        while (!stopping)
+        {
+            wake.wait_for(guard, commitInterval);
+            guard.unlock();
+            commit();
+            guard.lock();
+        }
+    }
+
+public:
+    static string filenameFor(const string &username)
+    {
+        return username + "_ledger.bin";
+    }
+
+    // True if path holds at least one complete record
+    static bool exists(const string &path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Record));
+    }
+
+    explicit TransactionLedger(const string &path, size_t batchSize = 4096,
+                               chrono::milliseconds commitInterval = chrono::milliseconds(20))
+        : batchSize(batchSize), commitInterval(commitInterval)
+    {
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            return;
+        }
+
+        // Drop a torn record left by a crash mid-write
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size % sizeof(Record) != 0)
+        {
+            if (ftruncate(fd, st.st_size - st.st_size % sizeof(Record)) != 0)
+            {
+                ::close(fd);
+                fd = -1;
+                return;
+            }
+        }
+
+        pending.reserve(batchSize);
+        if (commitInterval.count() > 0)
+        {
+            committer = thread(&TransactionLedger::runCommitter, this);
+        }
+    }
+
+    TransactionLedger(const TransactionLedger &) = delete;
+    TransactionLedger &operator=(const TransactionLedger &) = delete;
+
+    ~TransactionLedger()
+    {
+        if (committer.joinable())
+        {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            committer.join();
+        }
+
+        commit();
+
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    void append(const Transaction &transaction, EntityType entityType)
+    {
+        Kind kind;
+        if (fd < 0 || !kindFromType(transaction.type, kind))
+        {
+            return;
+        }
+
+        string_view name = transaction.asset;
+        bool full;
+        {
+            lock_guard<mutex> guard(lock);
+            while (name.size() > nameCapacity)
+            {
+                pending.push_back(makeRecord(transaction.date, 0, Kind::NamePart, entityType, name.substr(0, nameCapacity)));
+                name.remove_prefix(nameCapacity);
+            }
+            pending.push_back(makeRecord(transaction.date, transaction.amount, kind, entityType, name));
+            full = pending.size() >= batchSize;
+        }
+
+        if (full)
+        {
+            wake.notify_one();
+        }
+    }
+
+    // Writes everything appended so far and syncs it to disk
+    void commit()
+    {
+        lock_guard<mutex> committing(commitLock);
+        {
+            lock_guard<mutex> guard(lock);
+            if (pending.empty())
+            {
+                return;
+            }
+            swap(pending, writing);
+        }
+
+        const char *data = reinterpret_cast<const char *>(writing.data());
+        size_t remaining = writing.size() * sizeof(Record);
+
+        while (remaining > 0)
+        {
+            ssize_t written = ::write(fd, data, remaining);
+            if (written < 0)
+            {
+                cout << "Error writing transaction ledger!\n";
+                break;
+            }
+            data += written;
+            remaining -= static_cast<size_t>(written);
+        }
+
+        fdatasync(fd);
+        writing.clear();
+    }
+
+    // Calls apply(transaction, entityType) for every record in the ledger at
+    // path, oldest first. A torn trailing record is ignored.
+    static bool replay(const string &path, const function<void(const Transaction &, EntityType)> &apply)
+    {
+        MappedFile file;
+        if (!file.open(path))
+        {
+            return false;
+        }
+
+        size_t count = file.size() / sizeof(Record);
+        string name;
+        Record record;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            memcpy(&record, file.data() + i * sizeof(Record), sizeof(Record));
+            name.append(record.name, min<size_t>(record.nameLength, nameCapacity));
+
+            Kind kind = static_cast<Kind>(record.kind);
+            if (kind == Kind::NamePart)
+            {
+                continue;
+            }
+
+            if (record.entityType < entityTypeCount && record.kind <= static_cast<uint8_t>(Kind::Mark))
+            {
+                const char *type = kind == Kind::Add ? "Add" : kind == Kind::Buy ? "Buy" : kind == Kind::Sell ? "Sell" : "Mark";
+                Transaction transaction(name, record.amount, type);
+                transaction.date = static_cast<time_t>(record.date);
+                apply(transaction, static_cast<EntityType>(record.entityType));
+            }
+            name.clear();
+        }
+        return true;
+    }
+};
+
+// Outcome of a PortfolioManager operation. The manager never prompts or
+// prints; callers such as the console menu turn results into messages.
+enum class PortfolioStatus : uint8_t
+{
+    Ok,
+    NotFound,
+    InsufficientValue,
+    InvalidType,
+    Rejected,
+    RolledBack
+};
+
+constexpr string_view portfolioStatusMessage(PortfolioStatus status)
+{
+    switch (status)
+    {
+        case PortfolioStatus::Ok: return "OK";
+        case PortfolioStatus::NotFound: return "Entity not found.";
+        case PortfolioStatus::InsufficientValue: return "Insufficient value to complete the transaction.";
+        case PortfolioStatus::InvalidType: return "Invalid financial entity type!";
+        case PortfolioStatus::Rejected: return "Value has the wrong sign for its type.";
+        case PortfolioStatus::RolledBack: return "Not applied; another order in the batch failed.";
+    }
+    return "";
+}
+
+struct PortfolioResult
+{
+    PortfolioStatus status = PortfolioStatus::Ok;
+    FinancialEntity *entity = nullptr; // the entity added or traded, if any
+
+    bool ok() const { return status == PortfolioStatus::Ok; }
+};
+
+enum class TradeSide : uint8_t
+{
+    Buy,
+    Sell
+};
+
+struct TradeOrder
+{
+    string name;
+    TradeSide side;
+    double amount;
+};
+
+// Per-order results of PortfolioManager::executeBatch, in order order
+struct BatchResult
+{
+    vector<PortfolioResult> results;
+    size_t applied = 0;
+    bool committed = true; // false if an all-or-nothing batch was rolled back
+};
+
+// A new entity whose value has the wrong sign for its type: a negative Asset
+// or Equity, or a positive Liability. alternative is the type that sign fits.
+struct SignConflict
+{
+    string_view name;
+    double value;
+    EntityType requested;
+    EntityType alternative;
+};
+
+enum class ConflictResolution : uint8_t
+{
+    UseAlternative, // add under the alternative type with the value as given
+    FlipSign,       // keep the requested type and negate the value
+    Reject          // add nothing
+};
+
+using ConflictPolicy = function<ConflictResolution(const SignConflict &)>;
+
+inline ConflictResolution flipSignOnConflict(const SignConflict &)
+{
+    return ConflictResolution::FlipSign;
+}
+
+inline ConflictResolution rejectOnConflict(const SignConflict &)
+{
+    return ConflictResolution::Reject;
+}
+
+// Portfolio Manager class
+
+class PortfolioManager
+{
+
+private:
+    // Entity objects, the name map and the columnar store; heap-allocated so
+    // the addresses entities hold survive moves of the manager
+    unique_ptr<EntityStorage> storage = make_unique<EntityStorage>();
+
+    // Ledger that records every add, buy and sell, if one is attached
+    TransactionLedger *ledger = nullptr;
+
+    ConflictPolicy conflictPolicy = flipSignOnConflict;
+
+    // User whose saved files the portfolio matched when its dirty set was
+    // last cleared; empty if it never did
+    string persistedAs;
+
+    template <class T>
+    void createEntity(const string &name, double value)
+    {
+        EntityStore &store = storage->store;
+        uint32_t slot = store.append(name, value, T::tag, nullptr);
+        string_view interned = store.nameAt(slot);
+
+        T *object = storage->create<T>(interned, value);
+        object->slot = slot;
+        object->store = &store;
+        store.setObject(slot, object);
+        storage->entities.emplace(interned, EntityPtr(object));
+
+        record(Transaction(name, value, "Add"), T::tag);
+    }
+
+    void record(const Transaction &transaction, EntityType type)
+    {
+        if (ledger)
+        {
+            ledger->append(transaction, type);
+        }
+    }
+
+    // Applies a revalued mark and records it, so that replaying the ledger
+    // brings the value back; returns false if the value did not change
+    bool mark(uint32_t slot, double value)
+    {
+        if (isnan(value) || storage->store.valueData()[slot] == value)
+        {
+            return false;
+        }
+
+        storage->store.objectAt(slot)->currentValue = value;
+        storage->store.markValue(slot, value);
+        record(Transaction(string(storage->store.nameAt(slot)), value, "Mark"), storage->store.typeData()[slot]);
+        return true;
+    }
+
+    vector<FinancialEntity *> objectsAt(const vector<uint32_t> &slots) const
+    {
+        vector<FinancialEntity *> objects;
+        objects.reserve(slots.size());
+        for (uint32_t slot : slots)
+        {
+            objects.push_back(storage->store.objectAt(slot));
+        }
+        return objects;
+    }
+
+public:
+    PortfolioManager() = default;
+
+    // disable copy
+    PortfolioManager(const PortfolioManager&) = delete;
+    PortfolioManager& operator=(const PortfolioManager&) = delete;
+
+    // enable move
+    PortfolioManager(PortfolioManager&&) = default;
+    PortfolioManager& operator=(PortfolioManager&&) = default;
+
+    // Adding an Entity. A value of the wrong sign for a new entity's type
+    // is settled by policy, or by the portfolio's conflict policy if none is
+    // given; amounts added to an existing entity go to it whatever its type.
+    PortfolioResult addEntity(const string &name, double value, EntityType type, const ConflictPolicy &policy)
+    {
+        uint32_t slot = storage->store.find(name);
+
+        if (slot != EntityStore::npos)
+        {
+            FinancialEntity *entity = storage->store.objectAt(slot);
+            entity->addValue(value);
+            record(Transaction(name, value, "Add"), entity->typeTag);
+            return {PortfolioStatus::Ok, entity};
+        }
+
+        bool conflict = type == EntityType::Liability ? value > 0 : value < 0;
+        if (conflict)
+        {
+            EntityType alternative = type == EntityType::Liability ? EntityType::Asset : EntityType::Liability;
+
+            switch (policy(SignConflict{name, value, type, alternative}))
+            {
+                case ConflictResolution::UseAlternative: type = alternative; break;
+                case ConflictResolution::FlipSign: value = -1 * value; break;
+                case ConflictResolution::Reject: return {PortfolioStatus::Rejected, nullptr};
+            }
+        }
+
+        loadEntity(name, value, type);
+        return {PortfolioStatus::Ok, storage->store.objectAt(storage->store.find(name))};
+    }
+
+    PortfolioResult addEntity(const string &name, double value, EntityType type)
+    {
+        return addEntity(name, value, type, conflictPolicy);
+    }
+
+    PortfolioResult addEntity(const string &name, double value, const string &type)
+    {
+        EntityType parsed;
+        if (!parseEntityType(type, parsed))
+        {
+            return {PortfolioStatus::InvalidType, nullptr};
+        }
+        return addEntity(name, value, parsed, conflictPolicy);
+    }
+
+    // Policy used by addEntity calls that do not pass one; flips the sign
+    // of conflicting values unless replaced
+    void setConflictPolicy(ConflictPolicy policy)
+    {
+        conflictPolicy = std::move(policy);
+    }
+
+    // Non-interactive insert used by bulk loaders; the value is taken as
+    // already validated, so nothing is prompted
+    void loadEntity(const string &name, double value, EntityType type)
+    {
+        uint32_t slot = storage->store.find(name);
+
+        if (slot != EntityStore::npos)
+        {
+            FinancialEntity *entity = storage->store.objectAt(slot);
+            entity->addValue(value);
+            record(Transaction(name, value, "Add"), entity->typeTag);
+            return;
+        }
+
+        switch (type)
+        {
+            case EntityType::Asset: createEntity<Asset>(name, value); break;
+            case EntityType::Liability: createEntity<Liability>(name, value); break;
+            case EntityType::Equity: createEntity<Equity>(name, value); break;
+        }
+    }
+
+    const EntityMap &getEntities() const
+    {
+        return storage->entities;
+    }
+
+    AllocationStats allocationStats() const
+    {
+        AllocationStats stats;
+        stats.entities = storage->entities.size();
+        stats.heapAllocations = storage->upstream.allocationCount();
+        stats.heapBytes = storage->upstream.allocatedBytes();
+        return stats;
+    }
+
+    const EntityStore &getStore() const
+    {
+        return storage->store;
+    }
+
+    void reserve(size_t n)
+    {
+        storage->store.reserve(n);
+    }
+
+    // Slots of the entities added or changed since the portfolio last
+    // matched its saved files
+    const vector<uint32_t> &getDirtySlots() const
+    {
+        return storage->store.dirty();
+    }
+
+    // Records that the portfolio now matches username's saved files
+    void markPersisted(const string &username)
+    {
+        storage->store.clearDirty();
+        persistedAs = username;
+    }
+
+    bool isPersistedAs(const string &username) const
+    {
+        return !persistedAs.empty() && persistedAs == username;
+    }
+
+    // Function to display Portfolio
+
+    void showPortfolio(ostream &out = cout) const
+    {
+        if (storage->entities.empty())
+        {
+            out << "No financial entities in the portfolio!\n";
+        }
+
+        else
+        {
+            for (const auto &pair : storage->entities)
+            {
+                visitEntity(*pair.second, [&out](const auto &entity) { entity.showDetails(out); });
+                out << "------------------------\n";
+            }
+        }
+    }
+
+    // Function to search an Entity; nullptr if there is none by that name
+
+    FinancialEntity *searchEntity(const string &name) const
+    {
+        uint32_t slot = storage->store.find(name);
+
+        if (slot != EntityStore::npos)
+        {
+            return storage->store.objectAt(slot);
+        }
+
+        else
+        {
+            return nullptr;
+        }
+    }
+
+    // Total value of the Portfolio
+
+    double getTotalValue() const
+    {
+        PortfolioTotals totals = storage->store.totals();
+        double totalValue = 0;
+
+        for (double value : totals.value)
+        {
+            totalValue += value;
+        }
+
+        return totalValue;
+    }
+
+    // Buying an Entity
+
+    PortfolioResult buyEntity(const string &name, double amount)
+    {
+        FinancialEntity *entity = searchEntity(name);
+
+        if (!entity)
+        {
+            return {PortfolioStatus::NotFound, nullptr};
+        }
+
+        Transaction transaction(name, amount, "Buy");
+        Transaction::buy(*entity, amount);
+        record(transaction, entity->typeTag);
+        return {PortfolioStatus::Ok, entity};
+    }
+
+    // Function to Sell an Entity
+
+    PortfolioResult sellEntity(const string &name, double amount)
+    {
+        FinancialEntity *entity = searchEntity(name);
+
+        if (!entity)
+        {
+            return {PortfolioStatus::NotFound, nullptr};
+        }
+
+        Transaction transaction(name, amount, "Sell");
+        if (!Transaction::sell(*entity, amount))
+        {
+            return {PortfolioStatus::InsufficientValue, entity};
+        }
+        record(transaction, entity->typeTag);
+        return {PortfolioStatus::Ok, entity};
+    }
+
+    // Executes a batch of buy and sell orders. Orders are grouped by entity,
+    // so each entity is resolved and updated once; within an entity they
+    // apply in batch order, which gives every order the result it would have
+    // had on its own. With allOrNothing, one failed order leaves the
+    // portfolio untouched and the orders that would have succeeded come back
+    // as RolledBack.
+    BatchResult executeBatch(const vector<TradeOrder> &orders, bool allOrNothing = false)
+    {
+        struct Group
+        {
+            uint32_t slot;
+            double value;
+        };
+
+        EntityStore &store = storage->store;
+        BatchResult batch;
+        batch.results.resize(orders.size());
+        vector<Group> groups;
+        bool failed = false;
+
+        // Slot to group; a dense table unless the batch touches only a small
+        // part of a large portfolio
+        constexpr uint32_t none = EntityStore::npos;
+        bool dense = store.size() <= 8 * orders.size() + 64;
+        vector<uint32_t> denseGroups(dense ? store.size() : 0, none);
+        unordered_map<uint32_t, uint32_t> sparseGroups;
+
+        for (size_t i = 0; i < orders.size(); i++)
+        {
+            const TradeOrder &order = orders[i];
+            PortfolioResult &result = batch.results[i];
+            uint32_t slot = store.find(order.name);
+
+            if (slot == EntityStore::npos)
+            {
+                result.status = PortfolioStatus::NotFound;
+                failed = true;
+                continue;
+            }
+
+            uint32_t &group = dense ? denseGroups[slot] : sparseGroups.try_emplace(slot, none).first->second;
+            if (group == none)
+            {
+                group = static_cast<uint32_t>(groups.size());
+                groups.push_back(Group{slot, store.valueData()[slot]});
+            }
+
+            double &value = groups[group].value;
+            result.entity = store.objectAt(slot);
+
+            if (order.side == TradeSide::Buy)
+            {
+                value += order.amount;
+            }
+            else if (order.amount <= value)
+            {
+                value -= order.amount;
+            }
+            else
+            {
+                result.status = PortfolioStatus::InsufficientValue;
+                failed = true;
+            }
+        }
+
+        if (allOrNothing && failed)
+        {
+            for (PortfolioResult &result : batch.results)
+            {
+                if (result.ok())
+                {
+                    result.status = PortfolioStatus::RolledBack;
+                }
+            }
+            batch.committed = false;
+            return batch;
+        }
+
+        for (const Group &group : groups)
+        {
+            store.objectAt(group.slot)->setValue(group.value);
+        }
+
+        for (size_t i = 0; i < orders.size(); i++)
+        {
+            const PortfolioResult &result = batch.results[i];
+            if (!result.ok())
+            {
+                continue;
+            }
+
+            if (ledger)
+            {
+                const TradeOrder &order = orders[i];
+                record(Transaction(order.name, order.amount, order.side == TradeSide::Buy ? "Buy" : "Sell"), result.entity->typeTag);
+            }
+            batch.applied++;
+        }
+        return batch;
+    }
+
+    // Records all further transactions in ledger. An empty ledger is first
+    // seeded with the current holdings so that replaying it alone rebuilds
+    // the portfolio.
+    void attachLedger(TransactionLedger *newLedger, bool seed)
+    {
+        ledger = newLedger;
+
+        if (ledger && seed)
+        {
+            for (size_t i = 0; i < storage->store.size(); i++)
+            {
+                uint32_t slot = static_cast<uint32_t>(i);
+                record(Transaction(string(storage->store.nameAt(slot)), storage->store.valueData()[i], "Add"), storage->store.typeData()[i]);
+            }
+        }
+    }
+
+    // Applies one ledger record without prompting or re-recording it.
+    // Returns false if it could not be applied: a trade or mark on an
+    // unknown entity, or a sale larger than the entity's value.
+    bool applyTransaction(const Transaction &transaction, EntityType type)
+    {
+        TransactionLedger *attached = ledger;
+        ledger = nullptr;
+        storage->store.setEventTime(static_cast<int64_t>(transaction.date));
+        bool applied = true;
+
+        if (transaction.type == "Add")
+        {
+            loadEntity(transaction.asset, transaction.amount, type);
+        }
+
+        else
+        {
+            uint32_t slot = storage->store.find(transaction.asset);
+            if (slot == EntityStore::npos)
+            {
+                applied = false;
+            }
+            else if (transaction.type == "Mark")
+            {
+                mark(slot, transaction.amount);
+            }
+            else
+            {
+                FinancialEntity *entity = storage->store.objectAt(slot);
+                if (transaction.type == "Buy")
+                {
+                    entity->addValue(transaction.amount);
+                }
+                else
+                {
+                    applied = entity->subtractValue(transaction.amount);
+                }
+            }
+        }
+
+        storage->store.setEventTime(0);
+        ledger = attached;
+        return applied;
+    }
+
+    // Keeps a time-indexed value history of every entity from now on,
+    // starting from the values held when it is enabled
+    void enableHistory()
+    {
+        storage->store.enableHistory();
+    }
+
+    bool hasHistory() const
+    {
+        return storage->store.getHistory() != nullptr;
+    }
+
+    // Per-type totals as of time; empty if history is not enabled
+    PortfolioTotals getTotalsAt(time_t time) const
+    {
+        const PortfolioHistory *history = storage->store.getHistory();
+        return history ? history->totalsAt(time) : PortfolioTotals();
+    }
+
+    double getTotalValueAt(time_t time) const
+    {
+        PortfolioTotals totals = getTotalsAt(time);
+        double totalValue = 0;
+
+        for (double value : totals.value)
+        {
+            totalValue += value;
+        }
+
+        return totalValue;
+    }
+
+    // Value of one entity as of time (0 if it did not exist yet)
+    double getEntityValueAt(const string &name, time_t time) const
+    {
+        const PortfolioHistory *history = storage->store.getHistory();
+        uint32_t slot = storage->store.find(name);
+
+        if (!history || slot == EntityStore::npos)
+        {
+            return 0;
+        }
+        return history->entities[slot].valueAt(time);
+    }
+
+    // Net amount added to or traded into one entity up to time, leaving out
+    // revaluations
+    double getEntityFlowsAt(const string &name, time_t time) const
+    {
+        const PortfolioHistory *history = storage->store.getHistory();
+        uint32_t slot = storage->store.find(name);
+
+        if (!history || slot == EntityStore::npos)
+        {
+            return 0;
+        }
+        return history->flows[slot].valueAt(time);
+    }
+
+    // Value-over-time series of one entity between from and to: the value at
+    // from followed by one point per change
+    vector<pair<time_t, double>> getEntityValueSeries(const string &name, time_t from, time_t to) const
+    {
+        vector<pair<time_t, double>> series;
+        const PortfolioHistory *history = storage->store.getHistory();
+        uint32_t slot = storage->store.find(name);
+
+        if (history && slot != EntityStore::npos)
+        {
+            history->entities[slot].scan(from, to, [&series](int64_t time, double value) {
+                series.emplace_back(static_cast<time_t>(time), value);
+            });
+        }
+        return series;
+    }
+
+    // Sorted views by value. The first one builds a per-type order index,
+    // which every later change keeps current, so queries never re-sort.
+
+    // The k entities of type with the largest values, largest first. For
+    // liabilities, stored as negative values, smallestEntities gives the
+    // largest debts.
+    vector<FinancialEntity *> topEntities(EntityType type, size_t k)
+    {
+        return sortedEntities(type, 0, k, true);
+    }
+
+    vector<FinancialEntity *> smallestEntities(EntityType type, size_t k)
+    {
+        return sortedEntities(type, 0, k, false);
+    }
+
+    // One page of the entities of type sorted by value: count entries
+    // starting at rank offset, descending or ascending
+    vector<FinancialEntity *> sortedEntities(EntityType type, size_t offset, size_t count, bool descending = true)
+    {
+        EntityStore &store = storage->store;
+        store.enableValueOrder();
+        const ValueOrder &order = *store.getValueOrder(type);
+
+        vector<FinancialEntity *> page;
+        if (offset >= order.size())
+        {
+            return page;
+        }
+
+        count = min(count, order.size() - offset);
+        page.reserve(count);
+        if (descending)
+        {
+            auto it = order.find_by_order(order.size() - 1 - offset);
+            for (size_t i = 0; i < count; i++, --it)
+            {
+                page.push_back(store.objectAt(it->second));
+            }
+        }
+        else
+        {
+            auto it = order.find_by_order(offset);
+            for (size_t i = 0; i < count; i++, ++it)
+            {
+                page.push_back(store.objectAt(it->second));
+            }
+        }
+        return page;
+    }
+
+    // Entities of type with low <= value <= high in ascending order, at most
+    // limit of them
+    vector<FinancialEntity *> entitiesInRange(EntityType type, double low, double high, size_t limit = SIZE_MAX)
+    {
+        EntityStore &store = storage->store;
+        store.enableValueOrder();
+        const ValueOrder &order = *store.getValueOrder(type);
+
+        vector<FinancialEntity *> matches;
+        for (auto it = order.lower_bound({low, 0}); it != order.end() && it->first <= high && matches.size() < limit; ++it)
+        {
+            matches.push_back(store.objectAt(it->second));
+        }
+        return matches;
+    }
+
+    // Ranked name searches, ignoring case. The first one indexes every
+    // name; entities added afterwards are indexed as they are created.
+
+    // Entities whose names start with text, in name order ignoring case, so
+    // an exact match comes first
+    vector<FinancialEntity *> searchPrefix(string_view text, size_t limit = 20)
+    {
+        return objectsAt(storage->store.enableNameSearch().prefix(text, limit));
+    }
+
+    // Entities whose names contain text, earliest occurrence first
+    vector<FinancialEntity *> searchSubstring(string_view text, size_t limit = 20)
+    {
+        return objectsAt(storage->store.enableNameSearch().substring(text, limit));
+    }
+
+    // Entities whose names are within maxEdits insertions, deletions or
+    // substitutions of text, closest first
+    vector<FinancialEntity *> searchFuzzy(string_view text, size_t maxEdits = 2, size_t limit = 20)
+    {
+        return objectsAt(storage->store.enableNameSearch().fuzzy(text, maxEdits, limit));
+    }
+
+    // Mark-to-market. Makes name a position of quantity units of symbol,
+    // valued at the symbol's latest price once one is known. Trades on a
+    // position then change its quantity at the current price. Only the
+    // size of quantity counts: a liability is held short, so its value
+    // stays negative.
+    PortfolioResult linkPosition(const string &name, const string &symbol, double quantity)
+    {
+        EntityStore &store = storage->store;
+        uint32_t slot = store.find(name);
+        if (slot == EntityStore::npos)
+        {
+            return {PortfolioStatus::NotFound, nullptr};
+        }
+
+        quantity = store.typeData()[slot] == EntityType::Liability ? -fabs(quantity) : fabs(quantity);
+
+        store.enablePositions();
+        PositionTable &positions = *store.getPositions();
+        uint32_t symbolId = positions.symbolId(symbol);
+        positions.link(slot, symbolId, quantity);
+        mark(slot, quantity * positions.prices[symbolId]);
+        return {PortfolioStatus::Ok, store.objectAt(slot)};
+    }
+
+    // Records symbol's latest price and re-marks only the positions that
+    // hold it, found through the reverse index. Returns how many changed.
+    size_t updatePrice(const string &symbol, double price)
+    {
+        PositionTable *positions = storage->store.getPositions();
+        if (!positions)
+        {
+            return 0;
+        }
+
+        uint32_t symbolId = positions->symbolId(symbol);
+        positions->prices[symbolId] = price;
+
+        size_t changed = 0;
+        for (uint32_t position : positions->positionsBySymbol[symbolId])
+        {
+            changed += mark(positions->slots[position], positions->quantities[position] * price);
+        }
+        return changed;
+    }
+
+    // Re-marks every position at the latest prices: the marks are computed
+    // in one pass over the position columns, then only changed values are
+    // applied. Returns how many changed.
+    size_t revalueAll()
+    {
+        PositionTable *positions = storage->store.getPositions();
+        if (!positions)
+        {
+            return 0;
+        }
+
+        size_t count = positions->slots.size();
+        const double *quantities = positions->quantities.data();
+        const uint32_t *symbols = positions->symbolOf.data();
+        const double *prices = positions->prices.data();
+        vector<double> marks(count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            marks[i] = quantities[i] * prices[symbols[i]];
+        }
+
+        size_t changed = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            changed += mark(positions->slots[i], marks[i]);
+        }
+        return changed;
+    }
+
+    // Quantity and symbol of a linked entity; false if it is not a position
+    bool getPosition(const string &name, string &symbol, double &quantity) const
+    {
+        const PositionTable *positions = storage->store.getPositions();
+        uint32_t slot = storage->store.find(name);
+        if (!positions || slot == EntityStore::npos || positions->positionOf[slot] == PositionTable::npos)
+        {
+            return false;
+        }
+
+        uint32_t position = positions->positionOf[slot];
+        symbol.assign(positions->symbols[positions->symbolOf[position]]);
+        quantity = positions->quantities[position];
+        return true;
+    }
+};
+
+// UserIndex keeps users.txt in memory behind a hash index, so lookups no
+// longer rescan the file. The file is read once; later calls only parse
+// bytes appended since the last load, and a full reload happens if the file
+// shrinks or is replaced.
+
+class UserIndex
+{
+private:
+    string filename;
+    StringPool pool;
+    FlatStringIndex index;
+    vector<string_view> names;
+    vector<string_view> passwords;
+    off_t loadedBytes = 0;
+    timespec loadedMtime = {};
+    ino_t loadedInode = 0;
+    string lastLine; // last line parsed, newline included
+    string tail;     // unterminated last line, if any
+
+    // Splits a "username,password" line; the password stops at any further
+    // comma
+    static void splitRecord(string_view line, string_view &username, string_view &password)
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+
+        size_t comma = line.find(',');
+        username = line.substr(0, comma);
+        password = comma == string_view::npos ? string_view() : line.substr(comma + 1);
+        password = password.substr(0, password.find(','));
+    }
+
+    // Password of the unterminated last line if it names username and no
+    // complete record does
+    bool tailPassword(const string &username, string_view &password) const
+    {
+        string_view name;
+        splitRecord(tail, name, password);
+        return !tail.empty() && name == username && index.find(username) == FlatStringIndex::npos;
+    }
+
+    void reset()
+    {
+        pool.clear();
+        index.clear();
+        names.clear();
+        passwords.clear();
+        loadedBytes = 0;
+        lastLine.clear();
+        tail.clear();
+    }
+
+    // Whether file still holds the last line parsed where it was read from.
+    // A file rewritten in place, rather than appended to, rarely does.
+    bool lastLineUnchanged() const
+    {
+        ifstream file(filename, ios::binary);
+        string found(lastLine.size(), '\0');
+        file.seekg(loadedBytes - static_cast<off_t>(lastLine.size()));
+        file.read(&found[0], found.size());
+        return file && found == lastLine;
+    }
+
+    // Parses "username,password" lines in [begin, end)
+    void parseRecords(const char *begin, const char *end)
+    {
+        while (begin < end)
+        {
+            const char *eol = static_cast<const char *>(memchr(begin, '\n', end - begin));
+            const char *lineEnd = eol ? eol : end;
+            string_view line(begin, lineEnd - begin);
+
+            if (!line.empty() && line != "\r")
+            {
+                string_view username, password;
+                splitRecord(line, username, password);
+
+                // First record wins, matching the old top-to-bottom scan
+                if (index.find(username) == FlatStringIndex::npos)
+                {
+                    string_view stored = pool.store(username);
+                    index.insert(stored, static_cast<uint32_t>(passwords.size()));
+                    names.push_back(stored);
+                    passwords.push_back(pool.store(password));
+                }
+            }
+
+            begin = lineEnd + 1;
+        }
+    }
+
+    // Brings the index up to date with the file on disk
+    void sync()
+    {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0)
+        {
+            reset();
+            return;
+        }
+
+        // Once the file has been modified, anything but an append past what
+        // was parsed starts the index over
+        bool modified = st.st_mtim.tv_sec != loadedMtime.tv_sec || st.st_mtim.tv_nsec != loadedMtime.tv_nsec;
+        bool replaced = st.st_ino != loadedInode || st.st_size < loadedBytes ||
+                        (modified && (st.st_size == loadedBytes || !lastLineUnchanged()));
+        if (replaced)
+        {
+            reset();
+        }
+
+        if (st.st_size > loadedBytes)
+        {
+            ifstream file(filename, ios::binary);
+            file.seekg(loadedBytes);
+
+            string buffer(static_cast<size_t>(st.st_size - loadedBytes), '\0');
+            file.read(&buffer[0], buffer.size());
+            buffer.resize(static_cast<size_t>(file.gcount()));
+
+            // A line without its newline may still be being written, and the
+            // first record for a name wins, so it is not indexed; it is kept
+            // aside for lookups and read again once it is complete
+            size_t lastNewline = buffer.rfind('\n');
+            size_t consumed = lastNewline == string::npos ? 0 : lastNewline + 1;
+
+            parseRecords(buffer.data(), buffer.data() + consumed);
+            loadedBytes += consumed;
+            tail.assign(buffer, consumed, string::npos);
+
+            if (consumed > 0)
+            {
+                size_t previous = consumed >= 2 ? buffer.rfind('\n', consumed - 2) : string::npos;
+                size_t start = previous == string::npos ? 0 : previous + 1;
+                lastLine.assign(buffer, start, consumed - start);
+            }
+        }
+        else
+        {
+            tail.clear();
+        }
+
+        loadedMtime = st.st_mtim;
+        loadedInode = st.st_ino;
+    }
+
+public:
+    explicit UserIndex(const string &filename = "users.txt") : filename(filename) {}
+
+    bool contains(const string &username)
+    {
+        sync();
+        string_view password;
+        return index.find(username) != FlatStringIndex::npos || tailPassword(username, password);
+    }
+
+    bool checkPassword(const string &username, const string &password)
+    {
+        sync();
+        uint32_t id = index.find(username);
+        string_view pending;
+        return id != FlatStringIndex::npos ? passwords[id] == password : tailPassword(username, pending) && pending == password;
+    }
+
+    // Appends a record to the file and to the index
+    bool add(const string &username, const string &password)
+    {
+        sync();
+
+        ofstream file(filename, ios::app);
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        file << username << "," << password << "\n";
+        file.close();
+
+        // Pick up our own append through the same incremental path
+        sync();
+        return true;
+    }
+
+    // Registered usernames in file order
+    vector<string> usernames()
+    {
+        sync();
+        return vector<string>(names.begin(), names.end());
+    }
+
+    size_t size() const { return passwords.size(); }
+};
+
+// User Class
+
+class User
+{
+private:
+    string currentUsername;
+    unordered_map<string, PortfolioManager> userPortfolios;
+    UserIndex users;
+
+public:
+    // Check if a user exists in the file
+    bool userExists(const string &username)
+    {
+        return users.contains(username);
+    }
+
+    // User Registration
+    void registerUser()
+    {
+        string username, password;
+        cout << "Enter a username: ";
+        cin >> username;
+
+        if (userExists(username))
+        {
+            cout << "Username already exists. Please try again.\n";
+            return;
+        }
+
+        cout << "Enter a password: ";
+        cin >> password;
+
+        // Save new user to the file
+        if (users.add(username, password))
+        {
+            cout << "User registered successfully!\n";
+        }
+
+        else
+        {
+            cout << "Error: Could not open file for saving.\n";
+        }
+
+        userPortfolios[username] = PortfolioManager();
+    }
+
+    // User Login
+    bool loginUser()
+    {
+        string username, password;
+
+        cout << "Enter username: ";
+        cin >> username;
+
+        cout << "Enter password: ";
+        cin >> password;
+
+        // Check if the username and password match an entry in users.txt
+        if (users.checkPassword(username, password))
+        {
+            currentUsername = username;
+            cout << "Login successful! Welcome, " << username << ".\n";
+            return true;
+        }
+
+        // If no match found
+        cout << "Invalid username or password.\n";
+        return false;
+    }
+
+    // Returns the username of the currently logged in user
+    string getCurrentUsername() const
+    {
+        return currentUsername;
+    }
+
+    // Access the portfolio manager of the logged in user
+    PortfolioManager &getPortfolioManager()
+    {
+        return userPortfolios[currentUsername];
+    }
+};
+
+// Binary portfolio snapshot (username_portfolio.bin):
+//
+//   header   magic, version, entity count, string table size, checksum
+//   records  entityCount packed {value, name offset, name length, type}
+//   strings  entity names, back to back
+//
+// The checksum is FNV-1a over everything after the header. Loading maps the
+// file and reads names straight out of the mapping.
+class PortfolioSnapshot
+{
+private:
+    static constexpr char magic[8] = {'P', 'M', 'S', 'N', 'A', 'P', '\0', '\0'};
+    static constexpr uint32_t version = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t entityCount;
+        uint64_t stringBytes;
+        uint64_t checksum;
+    };
+
+    struct Record
+    {
+        double value;
+        uint32_t nameOffset;
+        uint32_t nameLength;
+        uint8_t type;
+        uint8_t padding[7];
+    };
+
+    static_assert(sizeof(Header) == 32, "snapshot header layout");
+    static_assert(sizeof(Record) == 24, "snapshot record layout");
+
+    static uint64_t checksum(const char *data, size_t size)
+    {
+        return hashString(string_view(data, size));
+    }
+
+public:
+    static string filenameFor(const string &username)
+    {
+        return username + "_portfolio.bin";
+    }
+
+    static bool write(const PortfolioManager &portfolio, const string &path)
+    {
+        const EntityStore &store = portfolio.getStore();
+        size_t count = store.size();
+
+        vector<Record> records(count);
+        string strings;
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            string_view name = store.nameAt(i);
+            Record &record = records[i];
+            memset(&record, 0, sizeof(record));
+            record.value = store.valueData()[i];
+            record.nameOffset = static_cast<uint32_t>(strings.size());
+            record.nameLength = static_cast<uint32_t>(name.size());
+            record.type = static_cast<uint8_t>(store.typeData()[i]);
+            strings.append(name.data(), name.size());
+        }
+
+        string body(reinterpret_cast<const char *>(records.data()), count * sizeof(Record));
+        body += strings;
+
+        Header header;
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.entityCount = static_cast<uint32_t>(count);
+        header.stringBytes = strings.size();
+        header.checksum = checksum(body.data(), body.size());
+
+        body.insert(0, reinterpret_cast<const char *>(&header), sizeof(header));
+        return replaceFile(path, body);
+    }
+
+    // Returns false, leaving the portfolio untouched, if the file is missing,
+    // truncated or fails its checksum
+    static bool load(PortfolioManager &portfolio, const string &path)
+    {
+        MappedFile file;
+        if (!file.open(path) || file.size() < sizeof(Header))
+        {
+            return false;
+        }
+
+        Header header;
+        memcpy(&header, file.data(), sizeof(header));
+
+        if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version)
+        {
+            return false;
+        }
+
+        size_t recordBytes = static_cast<size_t>(header.entityCount) * sizeof(Record);
+        if (file.size() != sizeof(Header) + recordBytes + header.stringBytes)
+        {
+            return false;
+        }
+
+        const char *body = file.data() + sizeof(Header);
+        if (checksum(body, file.size() - sizeof(Header)) != header.checksum)
+        {
+            return false;
+        }
+
+        const Record *records = reinterpret_cast<const Record *>(body);
+        const char *strings = body + recordBytes;
+
+        for (uint32_t i = 0; i < header.entityCount; i++)
+        {
+            if (records[i].type >= entityTypeCount ||
+                static_cast<uint64_t>(records[i].nameOffset) + records[i].nameLength > header.stringBytes)
+            {
+                return false;
+            }
+        }
+
+        portfolio.reserve(portfolio.getStore().size() + header.entityCount);
+
+        string name;
+        for (uint32_t i = 0; i < header.entityCount; i++)
+        {
+            const Record &record = records[i];
+            name.assign(strings + record.nameOffset, record.nameLength);
+            portfolio.loadEntity(name, record.value, static_cast<EntityType>(record.type));
+        }
+        return true;
+    }
+};
+
+// Outcomes of FileHandler's loads and saves. FileHandler itself never
+// prints; the console menu and the server report results their own way.
+enum class FileStatus : uint8_t
+{
+    Ok,
+    NotFound,
+    WriteFailed
+};
+
+constexpr string_view fileStatusMessage(FileStatus status)
+{
+    switch (status)
+    {
+        case FileStatus::Ok: return "OK";
+        case FileStatus::NotFound: return "Error opening file for loading!";
+        case FileStatus::WriteFailed: return "Error opening file for saving!";
+    }
+    return "";
+}
+
+struct FileResult
+{
+    FileStatus status = FileStatus::Ok;
+    string path;             // the file loaded from or saved to
+    bool fromLedger = false; // loaded by replaying the ledger
+    vector<string> warnings; // records skipped, or a snapshot not written
+
+    bool ok() const { return status == FileStatus::Ok; }
+};
+
+// FileHandler class handles the portfolio files.
+class FileHandler
+{
+public:
+    FinancialManager manager;
+
+    static string deltaFilenameFor(const string &username)
+    {
+        return username + "_portfolio.delta";
+    }
+
+    // Function to save the portfolio to a file. A portfolio that matches
+    // username's saved files only appends its changed entities to the delta
+    // file; otherwise, or once the delta outgrows half the base file, the
+    // base is rewritten (compactPortfolio).
+    FileResult savePortfolio(PortfolioManager &portfolio, const string &username)
+    {
+        if (!portfolio.isPersistedAs(username) || !appendDelta(portfolio, username))
+        {
+            return compactPortfolio(portfolio, username);
+        }
+
+        FileResult result;
+        result.path = username + "_portfolio.txt";
+        return result;
+    }
+
+    // Rewrites username_portfolio.txt and the snapshot in full, each through
+    // a temporary file and an atomic rename, then drops the delta file
+    FileResult compactPortfolio(PortfolioManager &portfolio, const string &username)
+    {
+        // Considering filename of format username_portfolio.txt
+
+        FileResult result;
+        result.path = username + "_portfolio.txt";
+        const EntityStore &store = portfolio.getStore();
+        string out;
+
+        for (uint32_t slot = 0; slot < store.size(); slot++)
+        {
+            appendRecord(out, store, slot);
+        }
+
+        if (!replaceFile(result.path, out))
+        {
+            result.status = FileStatus::WriteFailed;
+            return result;
+        }
+
+        // Binary snapshot alongside the CSV for fast loading
+        if (!PortfolioSnapshot::write(portfolio, PortfolioSnapshot::filenameFor(username)))
+        {
+            result.warnings.push_back("Warning: could not write portfolio snapshot.");
+        }
+
+        // The rename gave the base a new identity, so the delta no longer
+        // applies even if removing it does not survive a crash
+        ::unlink(deltaFilenameFor(username).c_str());
+        portfolio.markPersisted(username);
+        return result;
+    }
+
+    // Function to load the portfolio from a file. Fails with NotFound if
+    // there is no saved portfolio for username.
+
+    FileResult loadPortfolio(PortfolioManager &portfolio, const std::string &username)
+    {
+
+        FileResult result;
+        string filename = username + "_portfolio.txt";
+        string snapshot = PortfolioSnapshot::filenameFor(username);
+
+        // Prefer the snapshot unless the CSV was edited after it was written
+        struct stat csvStat, snapshotStat;
+        bool haveCsv = stat(filename.c_str(), &csvStat) == 0;
+        bool haveSnapshot = stat(snapshot.c_str(), &snapshotStat) == 0;
+
+        bool wasEmpty = portfolio.getStore().size() == 0;
+
+        if (haveSnapshot && (!haveCsv || !modifiedBefore(snapshotStat, csvStat)) &&
+            PortfolioSnapshot::load(portfolio, snapshot))
+        {
+            if (haveCsv)
+            {
+                applyDelta(portfolio, csvStat, deltaFilenameFor(username));
+            }
+            if (wasEmpty)
+            {
+                portfolio.markPersisted(username);
+            }
+
+            result.path = snapshot;
+            return result;
+        }
+
+        CsvReader reader(filename);
+
+        if (!reader.isOpen())
+        {
+            result.status = FileStatus::NotFound;
+            return result;
+        }
+
+        std::string name, type;
+        double value;
+
+        while (reader.next())
+        {
+            if (!parseLine(reader, name, value, type))
+            {
+                result.warnings.push_back(csvErrorMessage(filename, reader.error()));
+                continue;
+            }
+
+            PortfolioResult added = portfolio.addEntity(name, value, type);
+            if (!added.ok())
+            {
+                result.warnings.push_back(filename + ": " + name + ": " + string(portfolioStatusMessage(added.status)));
+            }
+        }
+
+        applyDelta(portfolio, csvStat, deltaFilenameFor(username));
+        if (wasEmpty)
+        {
+            portfolio.markPersisted(username);
+        }
+
+        result.path = filename;
+        return result;
+    }
+
+    // Restores a user's portfolio at login with history enabled. The ledger
+    // holds the full history once it exists; otherwise the saved portfolio
+    // is loaded. fromLedger is false if a new ledger still needs seeding
+    // with the loaded holdings.
+    FileResult restorePortfolio(PortfolioManager &portfolio, const string &username)
+    {
+        portfolio.enableHistory();
+        return loadCurrentPortfolio(portfolio, username);
+    }
+
+    // Loads the same holdings a login would, but without history: the
+    // ledger if there is one, otherwise the saved portfolio. Fails with
+    // NotFound if the user has neither.
+    FileResult loadCurrentPortfolio(PortfolioManager &portfolio, const string &username)
+    {
+        if (TransactionLedger::exists(TransactionLedger::filenameFor(username)))
+        {
+            FileResult replayed = replayLedger(portfolio, username);
+            if (replayed.ok())
+            {
+                return replayed;
+            }
+        }
+        return loadPortfolio(portfolio, username);
+    }
+
+    // Rebuilds the portfolio by replaying username_ledger.bin
+    FileResult replayLedger(PortfolioManager &portfolio, const string &username)
+    {
+        FileResult result;
+        result.path = TransactionLedger::filenameFor(username);
+        size_t failed = 0;
+        bool replayed = TransactionLedger::replay(result.path, [&portfolio, &failed](const Transaction &transaction, EntityType type) {
+            failed += !portfolio.applyTransaction(transaction, type);
+        });
+
+        if (!replayed)
+        {
+            result.status = FileStatus::NotFound;
+            return result;
+        }
+
+        // The rebuilt book no longer matches the one that was recorded
+        result.fromLedger = true;
+        if (failed > 0)
+        {
+            result.warnings.push_back("Warning: " + to_string(failed) + " record(s) in " + result.path + " could not be applied");
+        }
+        return result;
+    }
+
+private:
+    // Delta files start with a line naming the base file they apply to by
+    // inode, size and modification time; a base that has been rewritten or
+    // edited since no longer matches, and its stale delta is ignored
+    static string deltaHeader(const struct stat &base)
+    {
+        return "#base," + to_string(base.st_ino) + "," + to_string(base.st_size) + "," +
+               to_string(base.st_mtim.tv_sec) + "." + to_string(base.st_mtim.tv_nsec);
+    }
+
+    static bool deltaMatches(const string &delta, const struct stat &base)
+    {
+        ifstream file(delta);
+        string header;
+        return getline(file, header) && header == deltaHeader(base);
+    }
+
+    static bool modifiedBefore(const struct stat &a, const struct stat &b)
+    {
+        return a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec < b.st_mtim.tv_sec
+                                                    : a.st_mtim.tv_nsec < b.st_mtim.tv_nsec;
+    }
+
+    static void appendRecord(string &out, const EntityStore &store, uint32_t slot)
+    {
+        out += store.nameAt(slot);
+        out += ',';
+        appendNumber(out, store.valueData()[slot]);
+        out += ',';
+        out += entityTypeName(store.typeData()[slot]);
+        out += '\n';
+    }
+
+    // Appends the dirty entities' current values to the delta file and
+    // syncs it. Returns false, writing nothing, if the base is missing or
+    // the delta would outgrow half of it, so the caller compacts instead.
+    bool appendDelta(PortfolioManager &portfolio, const string &username)
+    {
+        constexpr off_t minimumCompactBytes = 64 * 1024;
+        string base = username + "_portfolio.txt";
+        string delta = deltaFilenameFor(username);
+
+        struct stat baseStat, deltaStat;
+        if (stat(base.c_str(), &baseStat) != 0)
+        {
+            return false;
+        }
+
+        const EntityStore &store = portfolio.getStore();
+        string out;
+        for (uint32_t slot : portfolio.getDirtySlots())
+        {
+            appendRecord(out, store, slot);
+        }
+        if (out.empty())
+        {
+            return true;
+        }
+
+        bool fresh = stat(delta.c_str(), &deltaStat) != 0 || !deltaMatches(delta, baseStat);
+        if (fresh)
+        {
+            out.insert(0, deltaHeader(baseStat) + "\n");
+        }
+
+        off_t deltaSize = fresh ? 0 : deltaStat.st_size;
+        if (deltaSize + static_cast<off_t>(out.size()) > max(baseStat.st_size / 2, minimumCompactBytes))
+        {
+            return false;
+        }
+
+        int fd = ::open(delta.c_str(), O_RDWR | O_CREAT | O_APPEND | (fresh ? O_TRUNC : 0), 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        // Close off a line torn by an earlier crash so it cannot swallow the
+        // first new record
+        char last;
+        if (!fresh && deltaSize > 0 && ::pread(fd, &last, 1, deltaSize - 1) == 1 && last != '\n')
+        {
+            out.insert(out.begin(), '\n');
+        }
+
+        bool written = writeFully(fd, out.data(), out.size()) && ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!written)
+        {
+            return false;
+        }
+
+        if (fresh)
+        {
+            syncParentDirectory(delta);
+        }
+        portfolio.markPersisted(username);
+        return true;
+    }
+
+    // Applies a delta file's records, each an entity's latest value, over a
+    // portfolio just loaded from base. Every record ends with its type name,
+    // so a line torn by a crash fails to parse and is skipped.
+    void applyDelta(PortfolioManager &portfolio, const struct stat &base, const string &delta)
+    {
+        if (!deltaMatches(delta, base))
+        {
+            return;
+        }
+
+        CsvReader reader(delta);
+        std::string name, typeName;
+        double value;
+        EntityType type;
+
+        reader.next();
+        while (reader.next())
+        {
+            if (!parseLine(reader, name, value, typeName) || !parseEntityType(typeName, type))
+            {
+                continue;
+            }
+
+            FinancialEntity *entity = portfolio.searchEntity(name);
+            if (entity)
+            {
+                entity->setValue(value);
+            }
+            else
+            {
+                portfolio.loadEntity(name, value, type);
+            }
+        }
+    }
+
+    // Helper function to split the current record into its fields
+    bool parseLine(CsvReader &reader, std::string &name, double &value, std::string &type)
+    {
+        if (!reader.number(1, value))
+        {
+            return false;
+        }
+
+        name.assign(reader.field(0).data(), reader.field(0).size());
+        type.assign(reader.field(2).data(), reader.field(2).size());
+        return true;
+    }
+};
+
+
+// Fixed set of worker threads, each with its own task deque. A worker takes
+// tasks from the back of its own deque and, once that is empty, steals from
+// the front of the others', so a few large tasks among many small ones do
+// not leave threads idle.
+class WorkStealingPool
+{
+private:
+    struct Worker
+    {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<size_t> nextWorker{0};
+    atomic<size_t> queued{0};
+    atomic<size_t> pending{0};
+    mutex idleLock;
+    condition_variable wake;
+    condition_variable finished;
+    bool stopping = false;
+
+    static size_t &currentIndex()
+    {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    // Pool whose worker the calling thread is, if any
+    static WorkStealingPool *&currentPool()
+    {
+        static thread_local WorkStealingPool *pool = nullptr;
+        return pool;
+    }
+
+    bool take(size_t self, function<void()> &task)
+    {
+        {
+            Worker &own = *workers[self];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < workers.size(); i++)
+        {
+            Worker &victim = *workers[(self + i) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(function<void()> &task)
+    {
+        queued--;
+        task();
+        task = nullptr;
+
+        if (pending.fetch_sub(1) == 1)
+        {
+            lock_guard<mutex> guard(idleLock);
+            finished.notify_all();
+        }
+    }
+
+    void run(size_t self)
+    {
+        currentIndex() = self;
+        currentPool() = this;
+        function<void()> task;
+
+        while (true)
+        {
+            if (take(self, task))
+            {
+                execute(task);
+                continue;
+            }
+
+            unique_lock<mutex> guard(idleLock);
+            wake.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+            {
+                return;
+            }
+        }
+    }
+
+public:
+    // Tasks submitted together and waited for together, apart from any
+    // other work on the pool
+    class TaskGroup
+    {
+    private:
+        friend class WorkStealingPool;
+
+        mutex lock;
+        condition_variable finished;
+        size_t pending = 0;
+    };
+
+    explicit WorkStealingPool(size_t threadCount = thread::hardware_concurrency())
+    {
+        threadCount = max<size_t>(1, threadCount);
+        for (size_t i = 0; i < threadCount; i++)
+        {
+            workers.push_back(make_unique<Worker>());
+        }
+        for (size_t i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool()
+    {
+        {
+            lock_guard<mutex> guard(idleLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : threads)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Index of the calling worker thread, for per-worker partial results
+    static size_t workerIndex() { return currentIndex(); }
+
+    // Queues task on the workers in turn
+    void submit(function<void()> task)
+    {
+        pending++;
+        {
+            Worker &worker = *workers[nextWorker++ % workers.size()];
+            lock_guard<mutex> guard(worker.lock);
+            worker.tasks.push_back(std::move(task));
+        }
+        queued++;
+
+        lock_guard<mutex> guard(idleLock);
+        wake.notify_one();
+    }
+
+    // Queues task as part of group
+    void submit(TaskGroup &group, function<void()> task)
+    {
+        {
+            lock_guard<mutex> guard(group.lock);
+            group.pending++;
+        }
+        submit([&group, task = std::move(task)] {
+            task();
+            lock_guard<mutex> guard(group.lock);
+            if (--group.pending == 0)
+            {
+                group.finished.notify_all();
+            }
+        });
+    }
+
+    // Blocks until every submitted task has run
+    void wait()
+    {
+        unique_lock<mutex> guard(idleLock);
+        finished.wait(guard, [this] { return pending == 0; });
+    }
+
+    // Blocks until every task of group has run. A worker of this pool runs
+    // queued tasks while it waits, so a task can wait on a group it
+    // submitted without tying up its thread.
+    void wait(TaskGroup &group)
+    {
+        if (currentPool() == this)
+        {
+            function<void()> task;
+            while (true)
+            {
+                {
+                    lock_guard<mutex> guard(group.lock);
+                    if (group.pending == 0)
+                    {
+                        return;
+                    }
+                }
+                if (!take(currentIndex(), task))
+                {
+                    // The rest of the group is running on other workers
+                    break;
+                }
+                execute(task);
+            }
+        }
+
+        unique_lock<mutex> guard(group.lock);
+        group.finished.wait(guard, [&group] { return group.pending == 0; });
+    }
+};
+
+// Single-pass aggregation over the columnar store. The inner loop selects
+// with comparisons instead of branches or indexed stores so the compiler can
+// vectorize it, and it runs in blocks with separate accumulators per lane.
+class PortfolioAggregator
+{
+public:
+    static PortfolioTotals aggregate(const EntityStore &store)
+    {
+        return aggregate(store.valueData(), store.typeData(), store.size());
+    }
+
+    static PortfolioTotals aggregate(const double *values, const EntityType *types, size_t count)
+    {
+        constexpr size_t lanes = 4;
+        double assets[lanes] = {}, liabilities[lanes] = {}, equities[lanes] = {};
+        size_t assetCount[lanes] = {}, liabilityCount[lanes] = {};
+
+        size_t i = 0;
+        for (; i + lanes <= count; i += lanes)
+        {
+            for (size_t lane = 0; lane < lanes; lane++)
+            {
+                double v = values[i + lane];
+                EntityType t = types[i + lane];
+                bool isAsset = t == EntityType::Asset;
+                bool isLiability = t == EntityType::Liability;
+                bool isEquity = t == EntityType::Equity;
+
+                assets[lane] += isAsset ? v : 0.0;
+                liabilities[lane] += isLiability ? v : 0.0;
+                equities[lane] += isEquity ? v : 0.0;
+                assetCount[lane] += isAsset;
+                liabilityCount[lane] += isLiability;
+            }
+        }
+
+        PortfolioTotals totals;
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            totals.value[0] += assets[lane];
+            totals.value[1] += liabilities[lane];
+            totals.value[2] += equities[lane];
+            totals.count[0] += assetCount[lane];
+            totals.count[1] += liabilityCount[lane];
+        }
+
+        for (; i < count; i++)
+        {
+            size_t t = static_cast<size_t>(types[i]);
+            totals.value[t] += values[i];
+            totals.count[t] += t != 2;
+        }
+
+        // Equity count falls out of the other two
+        totals.count[2] = count - totals.count[0] - totals.count[1];
+        return totals;
+    }
+};
+
+class PortfolioAnalytics
+{
+public:
+    // Running totals maintained by the portfolio; O(1) regardless of size
+    PortfolioTotals totals(const PortfolioManager &portfolio) const
+    {
+        return portfolio.getStore().totals();
+    }
+
+    // Full single-pass recomputation, for callers that want to bypass the
+    // running totals
+    PortfolioTotals recompute(const PortfolioManager &portfolio) const
+    {
+        return PortfolioAggregator::aggregate(portfolio.getStore());
+    }
+
+    // Function to calculate total assets value
+    double totalAssets(const PortfolioManager &portfolio) const
+    {
+        return totals(portfolio).of(EntityType::Asset);
+    }
+
+    // Function to calculate total liabilities value
+    double totalLiabilities(const PortfolioManager &portfolio) const
+    {
+        return totals(portfolio).of(EntityType::Liability);
+    }
+
+    // Function to calculate total equities value
+    double totalEquities(const PortfolioManager &portfolio) const
+    {
+        return totals(portfolio).of(EntityType::Equity);
+    }
+
+    // Function to generate a summary report
+    void showReport(const PortfolioManager &portfolio) const
+    {
+        PortfolioTotals summary = totals(portfolio);
+        double assets = summary.of(EntityType::Asset);
+        double liabilities = summary.of(EntityType::Liability);
+        double equities = summary.of(EntityType::Equity);
+        double netValue = summary.netValue();
+
+        cout << "\n--- Portfolio Summary Report ---\n";
+        cout << "Total Assets: $" << assets << "\n";
+        cout << "Total Liabilities: $" << liabilities << "\n";
+        cout << "Total Equities: $" << equities << "\n";
+        cout << "Net Portfolio Value: $" << netValue << "\n";
+        cout << "---------------------------------\n";
+    }
+
+    // Function to generate the summary report as of a past time
+    void showReportAt(const PortfolioManager &portfolio, time_t time) const
+    {
+        if (!portfolio.hasHistory())
+        {
+            cout << "Portfolio history is not available.\n";
+            return;
+        }
+
+        PortfolioTotals summary = portfolio.getTotalsAt(time);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&time));
+
+        cout << "\n--- Portfolio Report as of " << when << " ---\n";
+        cout << "Total Assets: $" << summary.of(EntityType::Asset) << "\n";
+        cout << "Total Liabilities: $" << summary.of(EntityType::Liability) << "\n";
+        cout << "Total Equities: $" << summary.of(EntityType::Equity) << "\n";
+        cout << "Net Portfolio Value: $" << summary.netValue() << "\n";
+        cout << "---------------------------------\n";
+    }
+
+    // Function to show distribution of entities by type
+    void entityDistribution(const PortfolioManager &portfolio) const
+    {
+        PortfolioTotals summary = totals(portfolio);
+
+        // Same alphabetical order the report has always used
+        const EntityType order[] = {EntityType::Asset, EntityType::Equity, EntityType::Liability};
+
+        cout << "\n--- Portfolio Entity Distribution ---\n";
+        for (EntityType type : order)
+        {
+            if (summary.countOf(type) > 0)
+            {
+                cout << entityTypeName(type) << ": " << summary.countOf(type) << "\n";
+            }
+        }
+        cout << "------------------------------------\n";
+    }
+};
+
+// Totals of every registered user's saved portfolio, as built by
+// FirmAnalytics
+struct FirmReport
+{
+    struct UserTotals
+    {
+        string username;
+        PortfolioTotals totals;
+        bool loaded = false;
+    };
+
+    vector<UserTotals> users;
+    PortfolioTotals firm;
+    size_t loaded = 0;
+};
+
+// Firm-wide rollup: loads all users' portfolios in parallel on a
+// WorkStealingPool, one task per user, from each user's ledger when there
+// is one, as a login does. Each worker sums the users it loaded
+// into its own partial totals, and the partials are combined at the end, so
+// workers never contend on a shared accumulator.
+class FirmAnalytics
+{
+private:
+    // One per worker, padded so partials do not share cache lines
+    struct alignas(64) Partial
+    {
+        PortfolioTotals totals;
+        size_t loaded = 0;
+    };
+
+public:
+    static FirmReport build(const vector<string> &usernames, WorkStealingPool &pool)
+    {
+        FirmReport report;
+        report.users.resize(usernames.size());
+        vector<Partial> partials(pool.size());
+        PortfolioAnalytics analytics;
+
+        for (size_t i = 0; i < usernames.size(); i++)
+        {
+            pool.submit([&report, &partials, &analytics, &usernames, i] {
+                FirmReport::UserTotals &user = report.users[i];
+                user.username = usernames[i];
+
+                PortfolioManager portfolio;
+                FileHandler files;
+                user.loaded = files.loadCurrentPortfolio(portfolio, user.username).ok();
+                if (!user.loaded)
+                {
+                    return;
+                }
+
+                user.totals = analytics.totals(portfolio);
+                Partial &partial = partials[WorkStealingPool::workerIndex()];
+                partial.totals += user.totals;
+                partial.loaded++;
+            });
+        }
+        pool.wait();
+
+        for (const Partial &partial : partials)
+        {
+            report.firm += partial.totals;
+            report.loaded += partial.loaded;
+        }
+        return report;
+    }
+
+    // Per-user summary lines followed by the firm-wide report and entity
+    // distribution, in the layout of PortfolioAnalytics
+    static void show(const FirmReport &report, ostream &out = cout)
+    {
+        out << "\n--- Per-User Summary ---\n";
+        out << "User,Assets,Liabilities,Equities,Net\n";
+        for (const FirmReport::UserTotals &user : report.users)
+        {
+            if (!user.loaded)
+            {
+                out << user.username << ",no saved portfolio\n";
+                continue;
+            }
+            out << user.username << "," << user.totals.of(EntityType::Asset) << ","
+                << user.totals.of(EntityType::Liability) << "," << user.totals.of(EntityType::Equity) << ","
+                << user.totals.netValue() << "\n";
+        }
+
+        const PortfolioTotals &firm = report.firm;
+        out << "\n--- Firm Summary Report (" << report.loaded << " of " << report.users.size() << " portfolios) ---\n";
+        out << "Total Assets: $" << firm.of(EntityType::Asset) << "\n";
+        out << "Total Liabilities: $" << firm.of(EntityType::Liability) << "\n";
+        out << "Total Equities: $" << firm.of(EntityType::Equity) << "\n";
+        out << "Net Portfolio Value: $" << firm.netValue() << "\n";
+
+        const EntityType order[] = {EntityType::Asset, EntityType::Equity, EntityType::Liability};
+
+        out << "\n--- Firm Entity Distribution ---\n";
+        for (EntityType type : order)
+        {
+            if (firm.countOf(type) > 0)
+            {
+                out << entityTypeName(type) << ": " << firm.countOf(type) << "\n";
+            }
+        }
+        out << "------------------------------------\n";
+    }
+};
+
+// Dense row-major matrix of doubles. Rows are padded with zeros to a
+// multiple of eight values, so kernels can always run whole SIMD blocks
+// over a row.
+class DenseMatrix
+{
+private:
+    size_t rowCount = 0;
+    size_t columnCount = 0;
+    size_t stride = 0;
+    vector<double> data;
+
+    // Columns rounded up to a multiple of 8; throws if rows * stride would
+    // not fit in size_t
+    static size_t paddedStride(size_t rows, size_t columns)
+    {
+        if (columns > SIZE_MAX - 7 || (rows != 0 && ((columns + 7) & ~size_t(7)) > SIZE_MAX / rows))
+        {
+            throw length_error("DenseMatrix dimensions too large");
+        }
+        return (columns + 7) & ~size_t(7);
+    }
+
+public:
+    DenseMatrix() = default;
+
+    DenseMatrix(size_t rows, size_t columns)
+        : rowCount(rows), columnCount(columns), stride(paddedStride(rows, columns)), data(rows * stride)
+    {
+    }
+
+    size_t rows() const { return rowCount; }
+    size_t columns() const { return columnCount; }
+    size_t rowStride() const { return stride; }
+
+    double *row(size_t r) { return data.data() + r * stride; }
+    const double *row(size_t r) const { return data.data() + r * stride; }
+
+    double &operator()(size_t r, size_t c) { return data[r * stride + c]; }
+    double operator()(size_t r, size_t c) const { return data[r * stride + c]; }
+};
+
+// Four doubles operated on together; GCC and Clang lower this to one AVX
+// register or a pair of SSE ones. Rows are read and written in place as
+// UnalignedLanes, and lanes are only passed by reference, so no vector
+// crosses a call by value.
+typedef double Lanes __attribute__((vector_size(32)));
+typedef double UnalignedLanes __attribute__((vector_size(32), aligned(8), may_alias));
+
+inline const UnalignedLanes &lanesAt(const double *from)
+{
+    return *reinterpret_cast<const UnalignedLanes *>(from);
+}
+
+inline UnalignedLanes &lanesAt(double *from)
+{
+    return *reinterpret_cast<UnalignedLanes *>(from);
+}
+
+inline double sumLanes(const Lanes &lanes)
+{
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// On x86-64 the hot kernels are also compiled for AVX2 and picked at load
+// time, without raising the baseline the rest of the program is built for.
+// ThreadSanitizer cannot run the load-time resolvers, so its builds do not.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && !defined(__SANITIZE_THREAD__)
+#define PMS_SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define PMS_SIMD_CLONES
+#endif
+
+// Adds the dot products of four rows of a with two rows of b over the
+// columns [from, to), a multiple of four apart, into out. Each loaded block
+// feeds several products, so the kernel is bound by arithmetic rather than
+// loads.
+PMS_SIMD_CLONES
+static void dotProducts4x2(const double *const a[4], const double *const b[2], size_t from, size_t to, double out[4][2])
+{
+    Lanes s00 = {}, s01 = {}, s10 = {}, s11 = {}, s20 = {}, s21 = {}, s30 = {}, s31 = {};
+
+    for (size_t t = from; t < to; t += 4)
+    {
+        Lanes b0 = lanesAt(b[0] + t), b1 = lanesAt(b[1] + t);
+        Lanes a0 = lanesAt(a[0] + t), a1 = lanesAt(a[1] + t);
+        s00 += a0 * b0;
+        s01 += a0 * b1;
+        s10 += a1 * b0;
+        s11 += a1 * b1;
+
+        Lanes a2 = lanesAt(a[2] + t), a3 = lanesAt(a[3] + t);
+        s20 += a2 * b0;
+        s21 += a2 * b1;
+        s30 += a3 * b0;
+        s31 += a3 * b1;
+    }
+
+    out[0][0] += sumLanes(s00);
+    out[0][1] += sumLanes(s01);
+    out[1][0] += sumLanes(s10);
+    out[1][1] += sumLanes(s11);
+    out[2][0] += sumLanes(s20);
+    out[2][1] += sumLanes(s21);
+    out[3][0] += sumLanes(s30);
+    out[3][1] += sumLanes(s31);
+}
+
+// out[t] += weight * row[t] over columns [0, count), count a multiple of four
+PMS_SIMD_CLONES
+static void addScaled(double *out, const double *row, double weight, size_t count)
+{
+    Lanes w = {weight, weight, weight, weight};
+    for (size_t t = 0; t < count; t += 4)
+    {
+        lanesAt(out + t) += w * lanesAt(row + t);
+    }
+}
+
+// Risk figures for the value series of a whole portfolio, as built by
+// RiskAnalytics::build. Amounts are in dollars of net value per period.
+struct RiskReport
+{
+    vector<string> names;
+    vector<double> values;
+    vector<double> volatility;
+
+    size_t observations = 0;
+    double netValue = 0;
+    double portfolioVolatility = 0;
+    double valueAtRisk95 = 0;
+    double valueAtRisk99 = 0;
+
+    // Between entities' returns, in names order; zero rows for entities
+    // whose value never moved
+    DenseMatrix correlation;
+};
+
+// Risk kernels over time series held one asset per row of a DenseMatrix,
+// observations along the row. Work is split across assets, on a
+// WorkStealingPool when one is given and inline otherwise.
+class RiskAnalytics
+{
+private:
+    // Assets per covariance tile and observations per pass over a tile;
+    // two tiles' worth of one pass (2 x 64 rows x 2KB) stay in L2
+    static constexpr size_t tileRows = 64;
+    static constexpr size_t tileColumns = 256;
+
+    // Runs work(begin, end) over [0, count) in chunks, in parallel on pool.
+    // Waits only for its own chunks, so other users can share the pool.
+    template <class Work>
+    static void forChunks(size_t count, size_t chunk, WorkStealingPool *pool, Work work)
+    {
+        WorkStealingPool::TaskGroup chunks;
+        for (size_t begin = 0; begin < count; begin += chunk)
+        {
+            size_t end = min(count, begin + chunk);
+            if (pool)
+            {
+                pool->submit(chunks, [&work, begin, end] { work(begin, end); });
+            }
+            else
+            {
+                work(begin, end);
+            }
+        }
+        if (pool)
+        {
+            pool->wait(chunks);
+        }
+    }
+
+    // Fills the tile rows [i0, i1) x [j0, j1) of the covariance sums. Past
+    // the ragged edges of a tile the kernel reads zeros, a row of them, and
+    // those products are discarded.
+    static void covarianceTile(const DenseMatrix &centered, const double *zeros, size_t i0, size_t i1, size_t j0, size_t j1,
+                               DenseMatrix &sums)
+    {
+        double tile[tileRows][tileRows] = {};
+        auto rowOf = [&](size_t r, size_t end) { return r < end ? centered.row(r) : zeros; };
+
+        for (size_t from = 0; from < centered.rowStride(); from += tileColumns)
+        {
+            size_t to = min(centered.rowStride(), from + tileColumns);
+            for (size_t i = i0; i < i1; i += 4)
+            {
+                const double *a[4] = {rowOf(i, i1), rowOf(i + 1, i1), rowOf(i + 2, i1), rowOf(i + 3, i1)};
+                for (size_t j = j0; j < j1; j += 2)
+                {
+                    const double *b[2] = {rowOf(j, j1), rowOf(j + 1, j1)};
+                    double out[4][2] = {};
+                    dotProducts4x2(a, b, from, to, out);
+
+                    for (size_t x = 0; x < 4 && i + x < i1; x++)
+                    {
+                        for (size_t y = 0; y < 2 && j + y < j1; y++)
+                        {
+                            tile[i + x - i0][j + y - j0] += out[x][y];
+                        }
+                    }
+                }
+            }
+        }
+
+        for (size_t i = i0; i < i1; i++)
+        {
+            for (size_t j = j0; j < j1; j++)
+            {
+                sums(i, j) = sums(j, i) = tile[i - i0][j - j0];
+            }
+        }
+    }
+
+public:
+    // Period-over-period returns of each row of prices: one fewer column.
+    // A period starting from zero has a return of zero.
+    static DenseMatrix returns(const DenseMatrix &prices, WorkStealingPool *pool = nullptr)
+    {
+        size_t periods = prices.columns() > 0 ? prices.columns() - 1 : 0;
+        DenseMatrix result(prices.rows(), periods);
+
+        forChunks(prices.rows(), tileRows, pool, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++)
+            {
+                const double *price = prices.row(r);
+                double *out = result.row(r);
+                for (size_t t = 0; t < periods; t++)
+                {
+                    out[t] = price[t] != 0 ? price[t + 1] / price[t] - 1 : 0;
+                }
+            }
+        });
+        return result;
+    }
+
+    // Returns of values held through trades: each period's change less the
+    // change in cumulative flows (amounts added or traded in), over the
+    // value at the start of the period
+    static DenseMatrix returns(const DenseMatrix &values, const DenseMatrix &flows, WorkStealingPool *pool = nullptr)
+    {
+        size_t periods = values.columns() > 0 ? values.columns() - 1 : 0;
+        DenseMatrix result(values.rows(), periods);
+
+        forChunks(values.rows(), tileRows, pool, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++)
+            {
+                const double *value = values.row(r);
+                const double *flow = flows.row(r);
+                double *out = result.row(r);
+                for (size_t t = 0; t < periods; t++)
+                {
+                    double change = value[t + 1] - value[t] - (flow[t + 1] - flow[t]);
+                    out[t] = value[t] != 0 ? change / value[t] : 0;
+                }
+            }
+        });
+        return result;
+    }
+
+    // Sample standard deviation of each row over a sliding window, one
+    // column per window end: returns.columns() - window + 1 columns. Each
+    // step adds one observation and drops one, so a row is a single pass.
+    static DenseMatrix rollingVolatility(const DenseMatrix &returns, size_t window, WorkStealingPool *pool = nullptr)
+    {
+        if (window < 2 || window > returns.columns())
+        {
+            return DenseMatrix(returns.rows(), 0);
+        }
+
+        DenseMatrix result(returns.rows(), returns.columns() - window + 1);
+        forChunks(returns.rows(), tileRows, pool, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++)
+            {
+                const double *x = returns.row(r);
+                double *out = result.row(r);
+
+                // Sums are taken about the first value, which keeps them
+                // small when returns sit far from zero
+                double shift = x[0], sum = 0, squares = 0;
+                for (size_t t = 0; t < returns.columns(); t++)
+                {
+                    double d = x[t] - shift;
+                    sum += d;
+                    squares += d * d;
+                    if (t >= window)
+                    {
+                        double old = x[t - window] - shift;
+                        sum -= old;
+                        squares -= old * old;
+                    }
+                    if (t + 1 >= window)
+                    {
+                        double variance = (squares - sum * sum / window) / (window - 1);
+                        out[t + 1 - window] = sqrt(max(variance, 0.0));
+                    }
+                }
+            }
+        });
+        return result;
+    }
+
+    // Sample covariance between every pair of rows. The rows are centered
+    // once, then the upper triangle of tiles is computed in parallel and
+    // mirrored. Needs at least two observations.
+    static DenseMatrix covariance(const DenseMatrix &returns, WorkStealingPool *pool = nullptr)
+    {
+        size_t n = returns.rows(), periods = returns.columns();
+        DenseMatrix result(n, n);
+        if (periods < 2)
+        {
+            return result;
+        }
+
+        DenseMatrix centered(n, periods);
+        forChunks(n, tileRows, pool, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++)
+            {
+                const double *x = returns.row(r);
+                double mean = accumulate(x, x + periods, 0.0) / periods;
+                for (size_t t = 0; t < periods; t++)
+                {
+                    centered(r, t) = x[t] - mean;
+                }
+            }
+        });
+
+        vector<double> zeros(centered.rowStride());
+        size_t tiles = (n + tileRows - 1) / tileRows;
+        forChunks(tiles * (tiles + 1) / 2, 1, pool, [&](size_t index, size_t) {
+            // Unrank index into the pair of tiles (ti <= tj) it stands for
+            size_t ti = 0;
+            while (index >= tiles - ti)
+            {
+                index -= tiles - ti;
+                ti++;
+            }
+            size_t tj = ti + index;
+
+            size_t i0 = ti * tileRows, j0 = tj * tileRows;
+            covarianceTile(centered, zeros.data(), i0, min(n, i0 + tileRows), j0, min(n, j0 + tileRows), result);
+        });
+
+        for (size_t i = 0; i < n; i++)
+        {
+            double *row = result.row(i);
+            for (size_t j = 0; j < n; j++)
+            {
+                row[j] /= static_cast<double>(periods - 1);
+            }
+        }
+        return result;
+    }
+
+    // Correlation matrix from a covariance matrix; rows without variance
+    // correlate as zero
+    static DenseMatrix correlation(const DenseMatrix &covariance)
+    {
+        size_t n = covariance.rows();
+        DenseMatrix result(n, n);
+        vector<double> scale(n);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            scale[i] = covariance(i, i) > 0 ? 1 / sqrt(covariance(i, i)) : 0;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                result(i, j) = covariance(i, j) * scale[i] * scale[j];
+            }
+        }
+        return result;
+    }
+
+    // w' C w: the variance of a portfolio holding weights of each asset
+    static double portfolioVariance(const DenseMatrix &covariance, const vector<double> &weights)
+    {
+        vector<double> padded(covariance.rowStride());
+        copy(weights.begin(), weights.end(), padded.begin());
+        Lanes total = {};
+
+        for (size_t i = 0; i < covariance.rows(); i++)
+        {
+            Lanes row = {};
+            const double *c = covariance.row(i);
+            for (size_t j = 0; j < padded.size(); j += 4)
+            {
+                row += lanesAt(c + j) * lanesAt(padded.data() + j);
+            }
+            Lanes w = {padded[i], padded[i], padded[i], padded[i]};
+            total += w * row;
+        }
+        return sumLanes(total);
+    }
+
+    // Profit or loss of a portfolio holding weights of each asset, per period
+    static vector<double> portfolioReturns(const DenseMatrix &returns, const vector<double> &weights, WorkStealingPool *pool = nullptr)
+    {
+        size_t workers = pool ? pool->size() : 1;
+        vector<vector<double>> partials(workers, vector<double>(returns.rowStride()));
+
+        // Each worker adds its assets into its own partial
+        forChunks(returns.rows(), tileRows, pool, [&](size_t begin, size_t end) {
+            vector<double> &partial = partials[pool ? WorkStealingPool::workerIndex() : 0];
+            for (size_t r = begin; r < end; r++)
+            {
+                addScaled(partial.data(), returns.row(r), weights[r], returns.rowStride());
+            }
+        });
+
+        vector<double> total(returns.rowStride());
+        for (const vector<double> &partial : partials)
+        {
+            addScaled(total.data(), partial.data(), 1, total.size());
+        }
+        total.resize(returns.columns());
+        return total;
+    }
+
+    // Historical value at risk: the loss that the portfolio's profit or loss
+    // per period stayed within at the given confidence, such as 0.99; zero
+    // if even that period was a gain
+    static double historicalVaR(const vector<double> &pnl, double confidence)
+    {
+        if (pnl.empty())
+        {
+            return 0;
+        }
+
+        vector<double> sorted(pnl);
+        size_t rank = min(sorted.size() - 1, static_cast<size_t>((1 - confidence) * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank] < 0 ? -sorted[rank] : 0.0;
+    }
+
+    // Risk of a portfolio's net value over observations periods of step
+    // seconds ending at until, from the recorded value of every entity.
+    // Amounts added or traded are taken out, so only revaluations count as
+    // returns. Needs the portfolio's history.
+    static RiskReport build(const PortfolioManager &portfolio, time_t until, time_t step, size_t observations, WorkStealingPool *pool = nullptr)
+    {
+        RiskReport report;
+        report.observations = observations;
+        if (!portfolio.hasHistory() || observations < 3)
+        {
+            return report;
+        }
+
+        report.netValue = portfolio.getStore().totals().netValue();
+        for (const auto &pair : portfolio.getEntities())
+        {
+            report.names.emplace_back(pair.first);
+            report.values.push_back(pair.second->getValue());
+        }
+
+        size_t n = report.names.size();
+        DenseMatrix values(n, observations), flows(n, observations);
+        forChunks(n, tileRows, pool, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++)
+            {
+                for (size_t t = 0; t < observations; t++)
+                {
+                    time_t when = until - static_cast<time_t>(observations - 1 - t) * step;
+                    values(r, t) = portfolio.getEntityValueAt(report.names[r], when);
+                    flows(r, t) = portfolio.getEntityFlowsAt(report.names[r], when);
+                }
+            }
+        });
+
+        DenseMatrix periodReturns = returns(values, flows, pool);
+        DenseMatrix periodCovariance = covariance(periodReturns, pool);
+
+        // Values are signed, so liabilities offset the assets they fund
+        report.portfolioVolatility = sqrt(max(portfolioVariance(periodCovariance, report.values), 0.0));
+        for (size_t i = 0; i < n; i++)
+        {
+            report.volatility.push_back(sqrt(periodCovariance(i, i)));
+        }
+        report.correlation = correlation(periodCovariance);
+
+        vector<double> pnl = portfolioReturns(periodReturns, report.values, pool);
+        report.valueAtRisk95 = historicalVaR(pnl, 0.95);
+        report.valueAtRisk99 = historicalVaR(pnl, 0.99);
+        return report;
+    }
+
+    static void show(const RiskReport &report, ostream &out = cout)
+    {
+        if (report.names.empty())
+        {
+            out << "Not enough portfolio history for a risk report.\n";
+            return;
+        }
+
+        out << "\n--- Portfolio Risk Report (" << report.observations << " observations) ---\n";
+        out << "Entity,Value,Volatility\n";
+        for (size_t i = 0; i < report.names.size(); i++)
+        {
+            out << report.names[i] << "," << report.values[i] << "," << report.volatility[i] * 100 << "%\n";
+        }
+        out << "Net Portfolio Value: $" << report.netValue << "\n";
+        out << "Volatility of Net Value: $" << report.portfolioVolatility << "\n";
+        out << "Value at Risk (95%): $" << report.valueAtRisk95 << "\n";
+        out << "Value at Risk (99%): $" << report.valueAtRisk99 << "\n";
+        out << "---------------------------------\n";
+    }
+};
+
+// Philox4x32-10 counter-based generator (Salmon et al., SC11). The output
+// is a pure function of a 128-bit counter and a 64-bit key, so any thread
+// can produce any part of a stream without generator state to share or
+// skip ahead.
+struct Philox4x32
+{
+    static constexpr uint32_t multiplier0 = 0xD2511F53;
+    static constexpr uint32_t multiplier1 = 0xCD9E8D57;
+    static constexpr uint32_t weyl0 = 0x9E3779B9;
+    static constexpr uint32_t weyl1 = 0xBB67AE85;
+
+    static void generate(uint32_t counter[4], uint32_t key0, uint32_t key1)
+    {
+        for (int round = 0; round < 10; round++)
+        {
+            uint64_t product0 = static_cast<uint64_t>(multiplier0) * counter[0];
+            uint64_t product1 = static_cast<uint64_t>(multiplier1) * counter[2];
+
+            uint32_t next0 = static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key0;
+            uint32_t next2 = static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key1;
+            counter[0] = next0;
+            counter[1] = static_cast<uint32_t>(product1);
+            counter[2] = next2;
+            counter[3] = static_cast<uint32_t>(product0);
+
+            key0 += weyl0;
+            key1 += weyl1;
+        }
+    }
+
+    // The same for lanes counters stored word by word, so that each round
+    // runs across the lanes and vectorizes
+    template <size_t lanes>
+    static void generate(uint32_t (&counter)[4][lanes], uint32_t key0, uint32_t key1)
+    {
+        for (int round = 0; round < 10; round++)
+        {
+            for (size_t lane = 0; lane < lanes; lane++)
+            {
+                uint64_t product0 = static_cast<uint64_t>(multiplier0) * counter[0][lane];
+                uint64_t product1 = static_cast<uint64_t>(multiplier1) * counter[2][lane];
+
+                uint32_t next0 = static_cast<uint32_t>(product1 >> 32) ^ counter[1][lane] ^ key0;
+                uint32_t next2 = static_cast<uint32_t>(product0 >> 32) ^ counter[3][lane] ^ key1;
+                counter[0][lane] = next0;
+                counter[1][lane] = static_cast<uint32_t>(product1);
+                counter[2][lane] = next2;
+                counter[3][lane] = static_cast<uint32_t>(product0);
+            }
+
+            key0 += weyl0;
+            key1 += weyl1;
+        }
+    }
+};
+
+// Positions whose values follow correlated geometric Brownian motions, plus
+// a fixed part that does not move. Drift and volatility are per step.
+struct ScenarioModel
+{
+    vector<string> names;
+    vector<double> values;
+    vector<double> drift;
+    vector<double> volatility;
+    double fixedValue = 0;
+
+    // Lower-triangular factor of the positions' correlation matrix; empty
+    // means independent
+    DenseMatrix factor;
+
+    // Factors correlation with its off-diagonal entries scaled by shrink;
+    // false if the result is not positive definite
+    bool choleskyFactor(const DenseMatrix &correlation, double shrink)
+    {
+        size_t n = correlation.rows();
+        DenseMatrix lower(n, n);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t j = 0; j <= i; j++)
+            {
+                double sum = i == j ? correlation(i, i) : shrink * correlation(i, j);
+                for (size_t k = 0; k < j; k++)
+                {
+                    sum -= lower(i, k) * lower(j, k);
+                }
+
+                if (i == j)
+                {
+                    if (sum <= 0)
+                    {
+                        return false;
+                    }
+                    lower(i, i) = sqrt(sum);
+                }
+                else
+                {
+                    lower(i, j) = sum / lower(j, j);
+                }
+            }
+        }
+
+        factor = std::move(lower);
+        return true;
+    }
+
+    // Assets and equities move with the same drift and volatility per
+    // step; liabilities are held fixed at the portfolio's running total of
+    // them, so the starting net value is the summary report's
+    static ScenarioModel fromPortfolio(const PortfolioManager &portfolio, double drift, double volatility)
+    {
+        ScenarioModel model;
+        model.fixedValue = portfolio.getStore().totals().of(EntityType::Liability);
+        for (const auto &pair : portfolio.getEntities())
+        {
+            if (pair.second->getTypeTag() == EntityType::Liability)
+            {
+                continue;
+            }
+            model.names.emplace_back(pair.first);
+            model.values.push_back(pair.second->getValue());
+            model.drift.push_back(drift);
+            model.volatility.push_back(volatility);
+        }
+        return model;
+    }
+
+    // Correlates the positions by the Cholesky factor of correlation. An
+    // estimate that is not positive definite, as from fewer observations
+    // than positions, has its off-diagonal entries shrunk toward zero until
+    // it is; returns false if that was needed.
+    bool correlate(const DenseMatrix &correlation)
+    {
+        for (double shrink : {1.0, 0.99, 0.95, 0.9, 0.75, 0.5, 0.25, 0.0})
+        {
+            if (choleskyFactor(correlation, shrink))
+            {
+                return shrink == 1.0;
+            }
+        }
+        return false;
+    }
+
+    // Every pair of positions correlated by the same amount
+    bool correlateEvenly(double pairwise)
+    {
+        size_t n = values.size();
+        DenseMatrix correlation(n, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                correlation(i, j) = i == j ? 1 : pairwise;
+            }
+        }
+        return correlate(correlation);
+    }
+
+    // Correlates the positions as their returns moved in report, matched
+    // by name. Returns false, leaving the model unchanged, unless every
+    // position moved over the report's history.
+    bool correlateFrom(const RiskReport &report)
+    {
+        unordered_map<string_view, size_t> rows;
+        for (size_t i = 0; i < report.names.size(); i++)
+        {
+            rows.emplace(report.names[i], i);
+        }
+
+        vector<size_t> index;
+        for (const string &name : names)
+        {
+            auto it = rows.find(name);
+            if (it == rows.end() || !(report.volatility[it->second] > 0))
+            {
+                return false;
+            }
+            index.push_back(it->second);
+        }
+
+        size_t n = names.size();
+        DenseMatrix correlation(n, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                correlation(i, j) = i == j ? 1 : report.correlation(index[i], index[j]);
+            }
+        }
+        correlate(correlation);
+        return true;
+    }
+
+    double netValue() const
+    {
+        return accumulate(values.begin(), values.end(), fixedValue);
+    }
+};
+
+// Net value of every simulated path at the horizon and at its lowest point
+// along the way, indexed by path
+struct ScenarioResult
+{
+    double startValue = 0;
+    vector<double> finalValues;
+    vector<double> worstValues;
+
+    // Value below which the given fraction of paths end up
+    static double percentile(const vector<double> &values, double fraction)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+
+        vector<double> sorted(values);
+        size_t rank = min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    double mean() const
+    {
+        return finalValues.empty() ? 0 : accumulate(finalValues.begin(), finalValues.end(), 0.0) / finalValues.size();
+    }
+};
+
+// Monte Carlo simulation of a ScenarioModel. Paths are split into tasks on
+// a WorkStealingPool and advanced in batches of batchLanes side by side:
+// state is kept per position with the batch's lanes contiguous, so every
+// inner loop runs across lanes and vectorizes. Each path's normals come
+// from Philox keyed by the seed at counter (path, step, position pair), so
+// the results do not depend on the thread count or how paths are batched.
+class MonteCarloEngine
+{
+private:
+    static constexpr size_t batchLanes = 8;
+    static constexpr size_t pathsPerTask = 1024;
+
+    // Two normals per position pair for each lane, by Box-Muller over
+    // 53-bit uniforms
+    PMS_SIMD_CLONES
+    static void normals(uint64_t firstPath, uint32_t step, size_t positions, uint64_t seed, double *out)
+    {
+        const double scale = 1.0 / 9007199254740992.0;
+        const double twoPi = 6.283185307179586;
+
+        for (size_t pair = 0; pair < (positions + 1) / 2; pair++)
+        {
+            uint32_t words[4][batchLanes];
+            for (size_t lane = 0; lane < batchLanes; lane++)
+            {
+                uint64_t path = firstPath + lane;
+                words[0][lane] = static_cast<uint32_t>(path);
+                words[1][lane] = static_cast<uint32_t>(path >> 32);
+                words[2][lane] = step;
+                words[3][lane] = static_cast<uint32_t>(pair);
+            }
+            Philox4x32::generate(words, static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32));
+
+            double *first = out + 2 * pair * batchLanes;
+            double *second = first + batchLanes;
+            for (size_t lane = 0; lane < batchLanes; lane++)
+            {
+                uint64_t bits1 = (static_cast<uint64_t>(words[0][lane]) << 32 | words[1][lane]) >> 11;
+                uint64_t bits2 = (static_cast<uint64_t>(words[2][lane]) << 32 | words[3][lane]) >> 11;
+
+                // In (0, 1], so the logarithm stays finite
+                double radius = sqrt(-2 * log((bits1 + 1) * scale));
+                double angle = twoPi * (bits2 * scale);
+                first[lane] = radius * cos(angle);
+                second[lane] = radius * sin(angle);
+            }
+        }
+    }
+
+    // Advances log growth by one step for every position and lane
+    PMS_SIMD_CLONES
+    static void advance(const ScenarioModel &model, const double *noise, double *shocks, double *growth)
+    {
+        size_t n = model.values.size();
+        const double *correlated = noise;
+
+        if (model.factor.rows() == n && n > 0)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                double *row = shocks + i * batchLanes;
+                fill(row, row + batchLanes, 0.0);
+                for (size_t k = 0; k <= i; k++)
+                {
+                    double weight = model.factor(i, k);
+                    const double *z = noise + k * batchLanes;
+                    for (size_t lane = 0; lane < batchLanes; lane++)
+                    {
+                        row[lane] += weight * z[lane];
+                    }
+                }
+            }
+            correlated = shocks;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            double sigma = model.volatility[i];
+            double mu = model.drift[i] - sigma * sigma / 2;
+            double *g = growth + i * batchLanes;
+            const double *z = correlated + i * batchLanes;
+            for (size_t lane = 0; lane < batchLanes; lane++)
+            {
+                g[lane] += mu + sigma * z[lane];
+            }
+        }
+    }
+
+    // Net value of each lane from its positions' log growth
+    static void netValues(const ScenarioModel &model, const double *growth, double *net)
+    {
+        fill(net, net + batchLanes, model.fixedValue);
+        for (size_t i = 0; i < model.values.size(); i++)
+        {
+            const double *g = growth + i * batchLanes;
+            for (size_t lane = 0; lane < batchLanes; lane++)
+            {
+                net[lane] += model.values[i] * exp(g[lane]);
+            }
+        }
+    }
+
+    static void simulateRange(const ScenarioModel &model, size_t begin, size_t end, size_t steps, uint64_t seed, ScenarioResult &result)
+    {
+        size_t n = model.values.size();
+        vector<double> noise(((n + 1) & ~size_t(1)) * batchLanes), shocks(n * batchLanes), growth(n * batchLanes);
+        double net[batchLanes], worst[batchLanes];
+
+        for (size_t first = begin; first < end; first += batchLanes)
+        {
+            fill(growth.begin(), growth.end(), 0.0);
+            fill(worst, worst + batchLanes, model.netValue());
+
+            for (size_t step = 0; step < steps; step++)
+            {
+                normals(first, static_cast<uint32_t>(step), n, seed, noise.data());
+                advance(model, noise.data(), shocks.data(), growth.data());
+                netValues(model, growth.data(), net);
+                for (size_t lane = 0; lane < batchLanes; lane++)
+                {
+                    worst[lane] = min(worst[lane], net[lane]);
+                }
+            }
+
+            // The last batch may run past end; its extra lanes are dropped
+            for (size_t lane = 0; lane < batchLanes && first + lane < end; lane++)
+            {
+                result.finalValues[first + lane] = steps ? net[lane] : model.netValue();
+                result.worstValues[first + lane] = worst[lane];
+            }
+        }
+    }
+
+public:
+    static ScenarioResult simulate(const ScenarioModel &model, size_t paths, size_t steps, uint64_t seed,
+                                   WorkStealingPool *pool = nullptr)
+    {
+        // Steps are part of each normal's 32-bit Philox counter
+        if (steps > UINT32_MAX)
+        {
+            throw length_error("Too many simulation steps");
+        }
+
+        ScenarioResult result;
+        result.startValue = model.netValue();
+        result.finalValues.resize(paths);
+        result.worstValues.resize(paths);
+
+        WorkStealingPool::TaskGroup tasks;
+        for (size_t begin = 0; begin < paths; begin += pathsPerTask)
+        {
+            size_t end = min(paths, begin + pathsPerTask);
+            if (pool)
+            {
+                pool->submit(tasks, [&model, &result, begin, end, steps, seed] { simulateRange(model, begin, end, steps, seed, result); });
+            }
+            else
+            {
+                simulateRange(model, begin, end, steps, seed, result);
+            }
+        }
+        if (pool)
+        {
+            pool->wait(tasks);
+        }
+        return result;
+    }
+
+    static void show(const ScenarioResult &result, ostream &out = cout)
+    {
+        size_t losses = count_if(result.finalValues.begin(), result.finalValues.end(),
+                                 [&result](double value) { return value < result.startValue; });
+
+        out << "\n--- Scenario Simulation (" << result.finalValues.size() << " paths) ---\n";
+        out << "Starting Net Value: $" << result.startValue << "\n";
+        out << "Mean Net Value: $" << result.mean() << "\n";
+        out << "Net Value Percentiles: 1%: $" << ScenarioResult::percentile(result.finalValues, 0.01)
+            << ", 5%: $" << ScenarioResult::percentile(result.finalValues, 0.05)
+            << ", 50%: $" << ScenarioResult::percentile(result.finalValues, 0.5)
+            << ", 95%: $" << ScenarioResult::percentile(result.finalValues, 0.95)
+            << ", 99%: $" << ScenarioResult::percentile(result.finalValues, 0.99) << "\n";
+        out << "Worst Point, 5% of Paths: $" << ScenarioResult::percentile(result.worstValues, 0.05) << "\n";
+        out << "Chance of Loss: " << (result.finalValues.empty() ? 0 : 100.0 * losses / result.finalValues.size()) << "%\n";
+        out << "---------------------------------\n";
+    }
+};
+
+// Epoch-based reclamation for versions published to lock-free readers.
+// Readers announce the epoch they entered in a per-thread slot and clear it
+// on exit; a retired version is freed once every announced epoch is newer
+// than the one it was retired in. Entering and leaving are a couple of
+// atomic stores, so reads never wait.
+class EpochDomain
+{
+private:
+    static constexpr size_t maxThreads = 256;
+    static constexpr uint64_t idle = UINT64_MAX;
+
+    struct alignas(64) Slot
+    {
+        atomic<uint64_t> epoch{idle};
+        atomic<bool> claimed{false};
+        unsigned depth = 0;
+    };
+
+    // Slots live apart from the domain so a thread that outlives it can
+    // still release its claim; registrations are keyed by id, never by
+    // address, so a later domain at the same address starts afresh
+    struct Slots
+    {
+        Slot slot[maxThreads];
+        atomic<bool> retired{false};
+    };
+
+    static inline atomic<uint64_t> nextId{1};
+
+    const uint64_t id = nextId.fetch_add(1, memory_order_relaxed);
+    const shared_ptr<Slots> slots = make_shared<Slots>();
+    atomic<uint64_t> globalEpoch{1};
+
+    // Claims a slot for the calling thread on first use; released when the
+    // thread exits
+    Slot &threadSlot()
+    {
+        struct Registration
+        {
+            uint64_t domain;
+            shared_ptr<Slots> owner;
+            Slot *slot;
+
+            Registration(uint64_t domain, shared_ptr<Slots> owner, Slot *slot) : domain(domain), owner(std::move(owner)), slot(slot) {}
+            Registration(Registration &&other) noexcept : domain(other.domain), owner(std::move(other.owner)), slot(other.slot)
+            {
+                other.slot = nullptr;
+            }
+            Registration &operator=(Registration &&other) noexcept
+            {
+                release();
+                domain = other.domain;
+                owner = std::move(other.owner);
+                slot = other.slot;
+                other.slot = nullptr;
+                return *this;
+            }
+            Registration(const Registration &) = delete;
+
+            void release()
+            {
+                if (slot)
+                {
+                    slot->claimed.store(false, memory_order_release);
+                }
+            }
+
+            ~Registration()
+            {
+                release();
+            }
+        };
+
+        thread_local vector<Registration> registrations;
+        for (const Registration &registration : registrations)
+        {
+            if (registration.domain == id)
+            {
+                return *registration.slot;
+            }
+        }
+
+        // Drop registrations for domains that have since been destroyed
+        registrations.erase(remove_if(registrations.begin(), registrations.end(),
+                                      [](const Registration &registration) { return registration.owner->retired.load(memory_order_acquire); }),
+                            registrations.end());
+
+        for (Slot &slot : slots->slot)
+        {
+            bool expected = false;
+            if (slot.claimed.compare_exchange_strong(expected, true))
+            {
+                registrations.emplace_back(id, slots, &slot);
+                return slot;
+            }
+        }
+        throw runtime_error("Too many reader threads");
+    }
+
+public:
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain &) = delete;
+    EpochDomain &operator=(const EpochDomain &) = delete;
+
+    ~EpochDomain()
+    {
+        slots->retired.store(true, memory_order_release);
+    }
+
+    void enter()
+    {
+        Slot &slot = threadSlot();
+        if (slot.depth++ == 0)
+        {
+            slot.epoch.store(globalEpoch.load(memory_order_acquire), memory_order_seq_cst);
+        }
+    }
+
+    void leave()
+    {
+        Slot &slot = threadSlot();
+        if (--slot.depth == 0)
+        {
+            slot.epoch.store(idle, memory_order_release);
+        }
+    }
+
+    // Ends the current epoch and returns it; anything unpublished before this
+    // call can be freed once safeToFree(returned epoch)
+    uint64_t advance()
+    {
+        return globalEpoch.fetch_add(1, memory_order_seq_cst);
+    }
+
+    bool safeToFree(uint64_t retiredEpoch) const
+    {
+        for (const Slot &slot : slots->slot)
+        {
+            if (slot.epoch.load(memory_order_seq_cst) <= retiredEpoch)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// ConcurrentPortfolio lets many threads read a portfolio while others trade
+// against it. Writers serialize on a mutex, mutate the PortfolioManager and
+// publish a new immutable PortfolioVersion. Readers take a Snapshot of the
+// current version without locking. Versions are split into chunks shared
+// between versions, so publishing one change copies one chunk plus the
+// chunk pointer table rather than the whole entity set.
+class ConcurrentPortfolio
+{
+public:
+    struct Row
+    {
+        string_view name;
+        double value;
+        EntityType type;
+    };
+
+    struct Chunk
+    {
+        vector<Row> rows;
+    };
+
+    struct Version
+    {
+        vector<shared_ptr<const Chunk>> chunks;
+        size_t size = 0;
+        PortfolioTotals totals;
+
+        const Row &row(size_t i) const { return chunks[i / chunkSize]->rows[i % chunkSize]; }
+    };
+
+    static constexpr size_t chunkSize = 256;
+
+    // Keeps the version it was taken from alive until destroyed
+    class Snapshot
+    {
+    private:
+        const ConcurrentPortfolio *owner;
+        const Version *version;
+
+    public:
+        explicit Snapshot(const ConcurrentPortfolio &portfolio) : owner(&portfolio)
+        {
+            owner->epochs.enter();
+            version = owner->current.load(memory_order_seq_cst);
+        }
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        ~Snapshot()
+        {
+            owner->epochs.leave();
+        }
+
+        const Version &operator*() const { return *version; }
+        const Version *operator->() const { return version; }
+    };
+
+private:
+    PortfolioManager &portfolio;
+    mutex writeLock;
+    atomic<const Version *> current{nullptr};
+    mutable EpochDomain epochs;
+    vector<pair<const Version *, uint64_t>> retired;
+
+    static Row rowAt(const EntityStore &store, size_t slot)
+    {
+        uint32_t i = static_cast<uint32_t>(slot);
+        return Row{store.nameAt(i), store.valueData()[i], store.typeData()[i]};
+    }
+
+    // Publishes a version in which the given slot is refreshed from the
+    // store (appending it if it is new). Caller holds writeLock.
+    void publish(size_t slot)
+    {
+        const EntityStore &store = portfolio.getStore();
+        const Version *old = current.load(memory_order_relaxed);
+        auto next = make_unique<Version>(*old);
+
+        size_t chunkIndex = slot / chunkSize;
+        auto chunk = chunkIndex < next->chunks.size() ? make_shared<Chunk>(*next->chunks[chunkIndex]) : make_shared<Chunk>();
+
+        if (slot % chunkSize < chunk->rows.size())
+        {
+            chunk->rows[slot % chunkSize] = rowAt(store, slot);
+        }
+        else
+        {
+            chunk->rows.push_back(rowAt(store, slot));
+        }
+
+        if (chunkIndex < next->chunks.size())
+        {
+            next->chunks[chunkIndex] = std::move(chunk);
+        }
+        else
+        {
+            next->chunks.push_back(std::move(chunk));
+        }
+
+        next->size = store.size();
+        next->totals = store.totals();
+        current.store(next.release(), memory_order_seq_cst);
+
+        retired.emplace_back(old, epochs.advance());
+        reclaim();
+    }
+
+    PortfolioResult published(PortfolioResult result)
+    {
+        if (result.ok())
+        {
+            publish(portfolio.getStore().find(result.entity->getNameView()));
+        }
+        return result;
+    }
+
+    void reclaim()
+    {
+        auto kept = retired.begin();
+        for (auto &entry : retired)
+        {
+            if (epochs.safeToFree(entry.second))
+            {
+                delete entry.first;
+            }
+            else
+            {
+                *kept++ = entry;
+            }
+        }
+        retired.erase(kept, retired.end());
+    }
+
+public:
+    // Wraps portfolio; from here on it must only be changed through this
+    // object, which must not outlive it
+    explicit ConcurrentPortfolio(PortfolioManager &portfolio) : portfolio(portfolio)
+    {
+        const EntityStore &store = portfolio.getStore();
+        auto version = make_unique<Version>();
+
+        for (size_t i = 0; i < store.size(); i += chunkSize)
+        {
+            auto chunk = make_shared<Chunk>();
+            for (size_t j = i; j < min(store.size(), i + chunkSize); j++)
+            {
+                chunk->rows.push_back(rowAt(store, j));
+            }
+            version->chunks.push_back(std::move(chunk));
+        }
+
+        version->size = store.size();
+        version->totals = store.totals();
+        current.store(version.release());
+    }
+
+    ConcurrentPortfolio(const ConcurrentPortfolio &) = delete;
+    ConcurrentPortfolio &operator=(const ConcurrentPortfolio &) = delete;
+
+    // No readers may be active when this runs
+    ~ConcurrentPortfolio()
+    {
+        for (auto &entry : retired)
+        {
+            delete entry.first;
+        }
+        delete current.load();
+    }
+
+    Snapshot snapshot() const
+    {
+        return Snapshot(*this);
+    }
+
+    // Writers mirror PortfolioManager's and publish the changed entity
+
+    PortfolioResult addEntity(const string &name, double value, EntityType type, const ConflictPolicy &policy)
+    {
+        lock_guard<mutex> guard(writeLock);
+        return published(portfolio.addEntity(name, value, type, policy));
+    }
+
+    PortfolioResult buyEntity(const string &name, double amount)
+    {
+        lock_guard<mutex> guard(writeLock);
+        return published(portfolio.buyEntity(name, amount));
+    }
+
+    PortfolioResult sellEntity(const string &name, double amount)
+    {
+        lock_guard<mutex> guard(writeLock);
+        return published(portfolio.sellEntity(name, amount));
+    }
+
+    // Readers below never block on writers
+
+    double getTotalValue() const
+    {
+        Snapshot view = snapshot();
+        double totalValue = 0;
+
+        for (double value : view->totals.value)
+        {
+            totalValue += value;
+        }
+
+        return totalValue;
+    }
+
+    PortfolioTotals totals() const
+    {
+        return snapshot()->totals;
+    }
+
+    void showReport(ostream &out = cout) const
+    {
+        PortfolioTotals summary = totals();
+
+        out << "\n--- Portfolio Summary Report ---\n";
+        out << "Total Assets: $" << summary.of(EntityType::Asset) << "\n";
+        out << "Total Liabilities: $" << summary.of(EntityType::Liability) << "\n";
+        out << "Total Equities: $" << summary.of(EntityType::Equity) << "\n";
+        out << "Net Portfolio Value: $" << summary.netValue() << "\n";
+        out << "---------------------------------\n";
+    }
+
+    // Same listing as PortfolioManager::showPortfolio, in name order
+    void showPortfolio(ostream &out = cout) const
+    {
+        Snapshot view = snapshot();
+        if (view->size == 0)
+        {
+            out << "No financial entities in the portfolio!\n";
+            return;
+        }
+
+        vector<const Row *> rows;
+        rows.reserve(view->size);
+        for (size_t i = 0; i < view->size; i++)
+        {
+            rows.push_back(&view->row(i));
+        }
+        sort(rows.begin(), rows.end(), [](const Row *a, const Row *b) { return a->name < b->name; });
+
+        for (const Row *row : rows)
+        {
+            out << entityTypeName(row->type) << " Name: " << row->name << "\n"
+                << "Current Value: $" << row->value << "\n";
+            out << "------------------------\n";
+        }
+    }
+};
+
+// Pushed to alert subscribers when an asset's price crosses their threshold
+struct AlertEvent {
+    string username;
+    string asset;
+    double threshold;
+    double initial_price;
+    double price;
+    double change;
+};
+
+using AlertCallback = function<void(const AlertEvent &)>;
+
+// Pushed every new price a watchlist applies: username, asset and price
+using PriceCallback = function<void(const string &, const string &, double)>;
+
+// Watchlist keeps each user's watchlist resident in memory, keyed by asset
+// name, so a price update is a hash lookup and a store. Changes are written
+// behind to username_watchlist.log, an append-only change log, and folded
+// back into username_watchlist.txt by periodic compaction.
+//
+// Log records: "+,name,initial_price"  add
+//              "=,name,price"          price update
+//              "-,name"                remove
+class Watchlist {
+private:
+    // Price at which a subscription's alert triggers for one asset
+    struct Band {
+        double price;
+        uint32_t subscription;
+
+        bool operator<(const Band &other) const { return price < other.price; }
+    };
+
+    struct Entry {
+        string name;
+        double initial_price;
+        double current_price;
+        bool live;
+
+        // Alert edges derived from initial_price, sorted by price. An alert
+        // fires when the price moves up to or past an upper edge, or down to
+        // or past a lower edge.
+        vector<Band> upper;
+        vector<Band> lower;
+    };
+
+    struct Subscription {
+        uint32_t id;
+        double threshold;
+        AlertCallback callback;
+        bool active;
+    };
+
+    struct Book {
+        vector<Entry> entries;
+        unordered_map<string, size_t> index;
+        ofstream log;
+        size_t log_records = 0;
+        size_t live_count = 0;
+        vector<Subscription> subscriptions;
+        uint32_t console_alert = UINT32_MAX; // subscription printing alerts, if any
+    };
+
+    unordered_map<string, Book> books;
+    bool write_through;
+    string pending;
+    vector<pair<uint32_t, PriceCallback>> price_listeners;
+    uint32_t next_listener = 0;
+
+    void publish_price(const string &username, const string &asset, double price) {
+        for (const auto &listener : price_listeners) {
+            listener.second(username, asset, price);
+        }
+    }
+
+    static string base_path(const string &username) { return username + "_watchlist.txt"; }
+    static string log_path(const string &username) { return username + "_watchlist.log"; }
+
+    static void apply_add(Book &book, string_view name, double initial_price, double current_price) {
+        string key(name);
+        auto it = book.index.find(key);
+        if (it != book.index.end()) {
+            Entry &entry = book.entries[it->second];
+            if (!entry.live) {
+                book.live_count++;
+            }
+            entry.initial_price = initial_price;
+            entry.current_price = current_price;
+            entry.live = true;
+            build_bands(book, entry);
+            return;
+        }
+
+        book.index.emplace(key, book.entries.size());
+        book.entries.push_back(Entry{std::move(key), initial_price, current_price, true, {}, {}});
+        book.live_count++;
+        build_bands(book, book.entries.back());
+    }
+
+    static void add_band(Entry &entry, const Subscription &subscription) {
+        if (entry.initial_price == 0) {
+            return;
+        }
+
+        double a = entry.initial_price * (1 + subscription.threshold / 100);
+        double b = entry.initial_price * (1 - subscription.threshold / 100);
+        Band high{max(a, b), subscription.id};
+        Band low{min(a, b), subscription.id};
+
+        entry.upper.insert(upper_bound(entry.upper.begin(), entry.upper.end(), high), high);
+        entry.lower.insert(upper_bound(entry.lower.begin(), entry.lower.end(), low), low);
+    }
+
+    static void build_bands(Book &book, Entry &entry) {
+        entry.upper.clear();
+        entry.lower.clear();
+        for (const Subscription &subscription : book.subscriptions) {
+            if (subscription.active) {
+                add_band(entry, subscription);
+            }
+        }
+    }
+
+    // Fires the alerts whose edges lie between the old and new price; only
+    // those edges are visited, found by binary search
+    void fire_alerts(const string &username, Book &book, const Entry &entry, double old_price) {
+        double new_price = entry.current_price;
+        vector<Band>::const_iterator first, last;
+
+        if (new_price > old_price) {
+            first = upper_bound(entry.upper.begin(), entry.upper.end(), Band{old_price, 0});
+            last = upper_bound(entry.upper.begin(), entry.upper.end(), Band{new_price, 0});
+        } else if (new_price < old_price) {
+            first = lower_bound(entry.lower.begin(), entry.lower.end(), Band{new_price, 0});
+            last = lower_bound(entry.lower.begin(), entry.lower.end(), Band{old_price, 0});
+        } else {
+            return;
+        }
+
+        double change = ((new_price - entry.initial_price) / entry.initial_price) * 100;
+        for (; first != last; ++first) {
+            Subscription &subscription = book.subscriptions[first->subscription];
+            if (subscription.active) {
+                subscription.callback(AlertEvent{username, entry.name, subscription.threshold,
+                                                 entry.initial_price, new_price, change});
+            }
+        }
+    }
+
+    static Entry *find_entry(Book &book, string_view name) {
+        auto it = book.index.find(string(name));
+        if (it == book.index.end() || !book.entries[it->second].live) {
+            return nullptr;
+        }
+        return &book.entries[it->second];
+    }
+
+    static bool apply_remove(Book &book, string_view name) {
+        Entry *entry = find_entry(book, name);
+        if (!entry) {
+            return false;
+        }
+        entry->live = false;
+        book.live_count--;
+        return true;
+    }
+
+    // Loads the base file and replays the change log on first use
+    Book &book_for(const string &username) {
+        auto it = books.find(username);
+        if (it != books.end()) {
+            return it->second;
+        }
+
+        Book &book = books[username];
+
+        string path = base_path(username);
+        CsvReader base(path);
+        string_view name;
+        double initial_price, current_price;
+        while (base.next()) {
+            if (!parse_entry(base, name, initial_price, current_price)) {
+                reportCsvError(path, base.error());
+                continue;
+            }
+            apply_add(book, name, initial_price, current_price);
+        }
+
+        path = log_path(username);
+        CsvReader log(path);
+        while (log.next()) {
+            string_view op = log.field(0);
+            name = log.field(1);
+            double price;
+
+            if (op == "-") {
+                apply_remove(book, name);
+            } else if ((op == "+" || op == "=") && log.number(2, price)) {
+                Entry *entry = find_entry(book, name);
+                if (op == "+") {
+                    apply_add(book, name, price, price);
+                } else if (entry) {
+                    entry->current_price = price;
+                }
+            } else {
+                reportCsvError(path, log.error());
+            }
+            book.log_records++;
+        }
+
+        book.log.open(log_path(username), ios::app);
+        return book;
+    }
+
+    void append_log(const string &username, Book &book, char op, string_view name, const double *price) {
+        pending.clear();
+        pending += op;
+        pending += ',';
+        pending.append(name.data(), name.size());
+        if (price) {
+            pending += ',';
+            appendNumber(pending, *price);
+        }
+        pending += '\n';
+
+        book.log.write(pending.data(), pending.size());
+        if (write_through) {
+            book.log.flush();
+        }
+        book.log_records++;
+
+        // Compact once the log outgrows the live set
+        if (book.log_records >= max<size_t>(1024, 2 * book.live_count)) {
+            compact(username);
+        }
+    }
+
+public:
+    // With write_through off, log appends stay in the stream buffer until
+    // flush(), compaction or destruction.
+    explicit Watchlist(bool write_through = true) : write_through(write_through) {}
+
+    ~Watchlist() {
+        for (auto &book : books) {
+            book.second.log.flush();
+        }
+    }
+
+    void add_asset(const string &username, const string &asset_name, double initial_price) {
+        Book &book = book_for(username);
+        if (!book.log.is_open()) {
+            cout << "Error opening watchlist file!\n";
+            return;
+        }
+
+        apply_add(book, asset_name, initial_price, initial_price);
+        append_log(username, book, '+', asset_name, &initial_price);
+        cout << "Added " << asset_name << " to the watchlist.\n";
+    }
+
+    void remove_asset(const string &username, const string &asset_name) {
+        Book &book = book_for(username);
+
+        if (apply_remove(book, asset_name)) {
+            append_log(username, book, '-', asset_name, nullptr);
+            cout << "Removed " << asset_name << " from the watchlist.\n";
+        } else {
+            cout << "Asset " << asset_name << " not found in the watchlist.\n";
+        }
+    }
+
+    void track_performance(const string &username) {
+        for (const Entry &entry : book_for(username).entries) {
+            if (entry.live) {
+                double change = ((entry.current_price - entry.initial_price) / entry.initial_price) * 100;
+                cout << "Asset: " << entry.name << ", Price Change: " << change << "%\n";
+            }
+        }
+    }
+
+    // Registers a standing alert: callback is pushed an AlertEvent whenever
+    // a price update moves an asset to threshold percent or more away from
+    // its initial price. Returns an id for unsubscribe_alerts.
+    uint32_t subscribe_alerts(const string &username, double threshold, AlertCallback callback) {
+        Book &book = book_for(username);
+        uint32_t id = static_cast<uint32_t>(book.subscriptions.size());
+        book.subscriptions.push_back(Subscription{id, abs(threshold), std::move(callback), true});
+
+        for (Entry &entry : book.entries) {
+            add_band(entry, book.subscriptions.back());
+        }
+        return id;
+    }
+
+    // Registers callback for every price the watchlist applies, from
+    // update_price and ingest_ticks, so portfolios can mark positions to
+    // market. Returns an id for unsubscribe_prices.
+    uint32_t subscribe_prices(PriceCallback callback) {
+        price_listeners.emplace_back(next_listener, std::move(callback));
+        return next_listener++;
+    }
+
+    void unsubscribe_prices(uint32_t id) {
+        price_listeners.erase(remove_if(price_listeners.begin(), price_listeners.end(),
+                                        [id](const auto &listener) { return listener.first == id; }),
+                              price_listeners.end());
+    }
+
+    // Latest price of an asset on username's watchlist
+    bool get_price(const string &username, const string &asset_name, double &price) {
+        Entry *entry = find_entry(book_for(username), asset_name);
+        if (!entry) {
+            return false;
+        }
+        price = entry->current_price;
+        return true;
+    }
+
+    void unsubscribe_alerts(const string &username, uint32_t id) {
+        Book &book = book_for(username);
+        if (id >= book.subscriptions.size() || !book.subscriptions[id].active) {
+            return;
+        }
+
+        book.subscriptions[id].active = false;
+        auto matches = [id](const Band &band) { return band.subscription == id; };
+        for (Entry &entry : book.entries) {
+            entry.upper.erase(remove_if(entry.upper.begin(), entry.upper.end(), matches), entry.upper.end());
+            entry.lower.erase(remove_if(entry.lower.begin(), entry.lower.end(), matches), entry.lower.end());
+        }
+    }
+
+    // Points the user's console alerts at threshold, replacing the previous
+    // console subscription if its threshold differs; true if it changed
+    bool set_console_alert(const string &username, double threshold) {
+        Book &book = book_for(username);
+        if (book.console_alert != UINT32_MAX && book.subscriptions[book.console_alert].threshold == abs(threshold)) {
+            return false;
+        }
+
+        if (book.console_alert != UINT32_MAX) {
+            unsubscribe_alerts(username, book.console_alert);
+        }
+        book.console_alert = subscribe_alerts(username, threshold, [](const AlertEvent &event) {
+            cout << "Significant change in " << event.asset << ": " << event.change << "%\n";
+        });
+        return true;
+    }
+
+    // Lists the assets already past threshold, then keeps a console alert
+    // subscribed so later price updates report crossings as they happen
+    void notify_significant_changes(const string &username, double threshold) {
+        Book &book = book_for(username);
+        for (const Entry &entry : book.entries) {
+            if (entry.live) {
+                double change = ((entry.current_price - entry.initial_price) / entry.initial_price) * 100;
+                if (abs(change) >= threshold) {
+                    cout << "Significant change in " << entry.name << ": " << change << "%\n";
+                }
+            }
+        }
+
+        if (set_console_alert(username, threshold)) {
+            cout << "Alerts for changes of " << abs(threshold) << "% or more are now active.\n";
+        }
+    }
+
+    void update_price(const string &username, const string &asset_name, double new_price) {
+        Book &book = book_for(username);
+        Entry *entry = find_entry(book, asset_name);
+
+        if (entry) {
+            double old_price = entry->current_price;
+            entry->current_price = new_price;
+            cout << "Updated price of " << asset_name << " to " << new_price << ".\n";
+            fire_alerts(username, book, *entry, old_price);
+            append_log(username, book, '=', asset_name, &new_price);
+            publish_price(username, asset_name, new_price);
+        } else {
+            cout << "Asset " << asset_name << " not found in the watchlist.\n";
+        }
+    }
+
+    struct IngestSummary {
+        size_t ticks = 0;
+        size_t assets_updated = 0;
+        size_t unknown_ticks = 0;
+        size_t bad_lines = 0;
+    };
+
+    // Applies a feed of "asset,price[,timestamp]" ticks from a file, or
+    // stdin for "-". Ticks are coalesced per asset (latest timestamp wins,
+    // then latest in the feed), applied in one pass with one log record per
+    // asset, and only the assets that changed are reported. A threshold of
+    // 0 or more sets the console alert first, as notify_significant_changes
+    // does, so crossings are reported through it; a negative one leaves the
+    // alerts as they are.
+    IngestSummary ingest_ticks(const string &username, const string &feed_path, double threshold = -1) {
+        IngestSummary summary;
+        CsvReader feed(feed_path);
+        if (!feed.isOpen()) {
+            cout << "Error opening price feed " << feed_path << "!\n";
+            return summary;
+        }
+
+        struct Tick {
+            double price;
+            double timestamp;
+        };
+
+        unordered_map<string, Tick> latest;
+        string name;
+        while (feed.next()) {
+            double price, timestamp = 0;
+            if (!feed.number(1, price) || (feed.fieldCount() > 2 && !feed.number(2, timestamp))) {
+                reportCsvError(feed_path, feed.error());
+                summary.bad_lines++;
+                continue;
+            }
+
+            summary.ticks++;
+            name.assign(feed.field(0).data(), feed.field(0).size());
+            auto it = latest.find(name);
+            if (it == latest.end()) {
+                latest.emplace(name, Tick{price, timestamp});
+            } else if (timestamp >= it->second.timestamp) {
+                it->second = Tick{price, timestamp};
+            }
+        }
+
+        if (threshold >= 0) {
+            set_console_alert(username, threshold);
+        }
+
+        Book &book = book_for(username);
+        bool saved_write_through = write_through;
+        write_through = false;
+
+        vector<const Entry *> changed;
+        for (const auto &tick : latest) {
+            Entry *entry = find_entry(book, tick.first);
+            if (!entry) {
+                summary.unknown_ticks++;
+                continue;
+            }
+
+            if (entry->current_price != tick.second.price) {
+                double old_price = entry->current_price;
+                entry->current_price = tick.second.price;
+                changed.push_back(entry);
+                fire_alerts(username, book, *entry, old_price);
+            }
+        }
+
+        // Log appends may compact, which moves entries; report first
+        for (const Entry *entry : changed) {
+            double change = ((entry->current_price - entry->initial_price) / entry->initial_price) * 100;
+            cout << "Asset: " << entry->name << ", Price Change: " << change << "%\n";
+        }
+
+        vector<pair<string, double>> updates;
+        updates.reserve(changed.size());
+        for (const Entry *entry : changed) {
+            updates.emplace_back(entry->name, entry->current_price);
+        }
+        for (const auto &update : updates) {
+            append_log(username, book, '=', update.first, &update.second);
+        }
+        for (const auto &update : updates) {
+            publish_price(username, update.first, update.second);
+        }
+
+        write_through = saved_write_through;
+        book.log.flush();
+
+        summary.assets_updated = updates.size();
+        cout << "Ingested " << summary.ticks << " ticks, updated " << summary.assets_updated << " assets";
+        if (summary.unknown_ticks > 0) {
+            cout << ", skipped " << summary.unknown_ticks << " assets not in the watchlist";
+        }
+        cout << ".\n";
+        return summary;
+    }
+
+    // Pushes buffered log records to the file
+    void flush(const string &username) {
+        auto it = books.find(username);
+        if (it != books.end()) {
+            it->second.log.flush();
+        }
+    }
+
+    // Rewrites the base file from memory through a temporary file and an
+    // atomic rename, then starts a fresh change log
+    void compact(const string &username) {
+        Book &book = book_for(username);
+        string path = base_path(username);
+        string temp = path + ".tmp";
+
+        string out;
+        for (const Entry &entry : book.entries) {
+            if (entry.live) {
+                out += entry.name;
+                out += ',';
+                appendNumber(out, entry.initial_price);
+                out += ',';
+                appendNumber(out, entry.current_price);
+                out += '\n';
+            }
+        }
+
+        ofstream file(temp, ios::trunc);
+        file << out;
+        file.close();
+        if (!file) {
+            cout << "Error compacting watchlist file!\n";
+            return;
+        }
+
+        if (rename(temp.c_str(), path.c_str()) != 0) {
+            cout << "Error compacting watchlist file!\n";
+            return;
+        }
+
+        // Every log record sets absolute state, so a crash before the log
+        // is truncated just replays it harmlessly over the new base file
+        book.entries.erase(remove_if(book.entries.begin(), book.entries.end(),
+                                     [](const Entry &entry) { return !entry.live; }),
+                           book.entries.end());
+        book.index.clear();
+        for (size_t i = 0; i < book.entries.size(); i++) {
+            book.index.emplace(book.entries[i].name, i);
+        }
+
+        book.log.close();
+        book.log.open(log_path(username), ios::trunc);
+        book.log_records = 0;
+    }
+
+private:
+    // Splits a "name,initial_price,current_price" record
+    static bool parse_entry(CsvReader &reader, string_view &name, double &initial_price, double &current_price) {
+        name = reader.field(0);
+        return reader.number(1, initial_price) && reader.number(2, current_price);
+    }
+};
+
+// Consider moving methods to classes for separation of concerns
+// NOTE: You also have duplicate methods, only keep one
+
+// Console conflict policy: asks whether to add under the other type
+ConflictResolution askOnConflict(const SignConflict& conflict) {
+    cout << entityTypeName(conflict.requested) << " value cannot be " << (conflict.value < 0 ? "negative" : "positive") << "!\n";
+    cout << "Shall I add in " << entityTypeName(conflict.alternative) << " instead? (y/n): ";
+
+    char choice = 'n';
+    cin >> choice;
+
+    return (choice == 'y' || choice == 'Y') ? ConflictResolution::UseAlternative : ConflictResolution::FlipSign;
+}
+
+// Links an entity to a watchlist asset so its value follows that price
+void linkPosition(User& userSystem, PortfolioManager& portfolio, Watchlist& myWatchlist) {
+    string name, symbol;
+    double quantity;
+
+    cout << "Enter entity name: ";
+    cin >> name;
+
+    cout << "Enter watchlist asset to price it by: ";
+    cin >> symbol;
+
+    cout << "Enter quantity held: ";
+    cin >> quantity;
+
+    PortfolioResult result = portfolio.linkPosition(name, symbol, quantity);
+    if (!result.ok()) {
+        cout << portfolioStatusMessage(result.status) << "\n";
+        return;
+    }
+
+    double price;
+    if (myWatchlist.get_price(userSystem.getCurrentUsername(), symbol, price)) {
+        portfolio.updatePrice(symbol, price);
+        cout << name << " is now valued at $" << result.entity->getValue() << ".\n";
+    } else {
+        cout << name << " will be valued once " << symbol << " has a price on your watchlist.\n";
+    }
+}
+
+void showTopEntities(PortfolioManager& portfolio) {
+    string type;
+    size_t count;
+
+    cout << "Enter entity type (Asset/Liability/Equity): ";
+    cin >> type;
+
+    cout << "How many entities to show: ";
+    cin >> count;
+
+    EntityType entityType;
+    if (!parseEntityType(type, entityType)) {
+        cout << portfolioStatusMessage(PortfolioStatus::InvalidType) << "\n";
+        return;
+    }
+
+    // Liabilities are stored as negative values; the largest are the lowest
+    vector<FinancialEntity *> top = entityType == EntityType::Liability ? portfolio.smallestEntities(entityType, count)
+                                                                        : portfolio.topEntities(entityType, count);
+    if (top.empty()) {
+        cout << "No " << type << " entities in the portfolio!\n";
+    }
+    for (FinancialEntity *entity : top) {
+        visitEntity(*entity, [](const auto &concrete) { concrete.showDetails(); });
+        cout << "------------------------\n";
+    }
+}
+
+// Clears a failed read and skips the rest of the line, so the menu can
+// carry on; end of input is left for the menu to see
+void skipBadInput() {
+    if (!cin.eof()) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+}
+
+// Reads a whole number from 1 to limit; anything else is reported and the
+// rest of the line skipped
+bool readCount(const string& prompt, long long limit, size_t& count) {
+    long long value;
+    cout << prompt;
+    if (!(cin >> value) || value < 1 || value > limit) {
+        cout << "Please enter a whole number from 1 to " << limit << ".\n";
+        skipBadInput();
+        return false;
+    }
+    count = static_cast<size_t>(value);
+    return true;
+}
+
+// Prints a FileHandler result: any warnings, then done and the file, or
+// why it failed
+void printFileResult(const FileResult& result, const string& done) {
+    for (const string& warning : result.warnings) {
+        cout << warning << "\n";
+    }
+    if (result.ok()) {
+        cout << done << result.path << "\n";
+    } else {
+        cout << fileStatusMessage(result.status) << "\n";
+    }
+}
+
+void showRiskReport(PortfolioManager& portfolio) {
+    // One hundred years of daily values
+    const long long maxDays = 36500;
+    size_t days;
+    if (!readCount("Enter the number of days to cover: ", maxDays, days)) {
+        return;
+    }
+
+    // One value per day, up to now
+    WorkStealingPool pool(max(1u, thread::hardware_concurrency()));
+    RiskReport report = RiskAnalytics::build(portfolio, time(nullptr), 24 * 60 * 60, days + 1, &pool);
+    RiskAnalytics::show(report);
+}
+
+void simulateScenarios(PortfolioManager& portfolio) {
+    // Paths are held in memory, and steps are counted in 32 bits by the
+    // generator; a century of trading days is plenty
+    const long long maxPaths = 10000000, maxDays = 25200;
+    size_t paths, days;
+    double annualReturn, annualVolatility;
+
+    if (!readCount("Enter the number of paths to simulate: ", maxPaths, paths) ||
+        !readCount("Enter the number of trading days ahead: ", maxDays, days)) {
+        return;
+    }
+    cout << "Enter the expected annual return of assets and equities (percentage): ";
+    if (!(cin >> annualReturn)) {
+        cout << "Return must be a number.\n";
+        skipBadInput();
+        return;
+    }
+    cout << "Enter their annual volatility (percentage): ";
+    if (!(cin >> annualVolatility) || annualVolatility < 0) {
+        cout << "Volatility must be a number no less than 0.\n";
+        skipBadInput();
+        return;
+    }
+
+    // Daily steps over a 252-day trading year; the fixed seed makes the
+    // same inputs give the same report
+    ScenarioModel model = ScenarioModel::fromPortfolio(portfolio, annualReturn / 100 / 252, annualVolatility / 100 / sqrt(252.0));
+    WorkStealingPool pool(max(1u, thread::hardware_concurrency()));
+
+    // Positions move together as they did over the past trading year, or
+    // by a correlation the user gives when there is no such history
+    RiskReport history = RiskAnalytics::build(portfolio, time(nullptr), 24 * 60 * 60, 253, &pool);
+    if (model.values.size() > 1 && !model.correlateFrom(history)) {
+        double pairwise;
+        cout << "Not enough history to estimate correlations.\n";
+        cout << "Enter the correlation between any two positions (-1 to 1): ";
+        if (!(cin >> pairwise) || pairwise < -1 || pairwise > 1) {
+            cout << "Correlation must be from -1 to 1.\n";
+            skipBadInput();
+            return;
+        }
+        model.correlateEvenly(pairwise);
+    }
+
+    MonteCarloEngine::show(MonteCarloEngine::simulate(model, paths, days, 1, &pool));
+}
+
+void addEntity(PortfolioManager& portfolio) {
+    string name, type;
+    double value;
+
+    cout << "Enter entity name: ";
+    cin >> name;
+
+    cout << "Enter entity type (Asset/Liability/Equity): ";
+    cin >> type;
+
+    cout << "Enter entity value: ";
+    cin >> value;
+
+    EntityType entityType;
+    if (!parseEntityType(type, entityType)) {
+        cout << portfolioStatusMessage(PortfolioStatus::InvalidType) << "\n";
+        return;
+    }
+
+    PortfolioResult result = portfolio.addEntity(name, value, entityType, askOnConflict);
+    if (!result.ok()) {
+        cout << portfolioStatusMessage(result.status) << "\n";
+    }
+}
+
+void buyEntity(PortfolioManager& portfolio) {
+    string name;
+    double amount;
+
+    cout << "Enter entity name to buy: ";
+    cin >> name;
+
+    cout << "Enter amount to buy: ";
+    cin >> amount;
+
+    PortfolioResult result = portfolio.buyEntity(name, amount);
+    if (result.ok()) {
+        cout << "Bought $" << amount << " of " << name << ".\n";
+    } else {
+        cout << portfolioStatusMessage(result.status) << "\n";
+    }
+}
+
+void sellEntity(PortfolioManager& portfolio) {
     string name;
     double amount;
 
-    cout << "Enter entity name to buy: ";
-    cin >> name;
+    cout << "Enter entity name to sell: ";
+    cin >> name;
+
+    cout << "Enter amount to sell: ";
+    cin >> amount;
+
+    PortfolioResult result = portfolio.sellEntity(name, amount);
+    if (result.ok()) {
+        cout << "Sold $" << amount << " of " << name << ".\n";
+    } else {
+        cout << portfolioStatusMessage(result.status) << "\n";
+    }
+}
+
+void getTotalPortfolioValue(User& userSystem, PortfolioManager& portfolio, FileHandler& fileHandler) {
+    string currentUser = userSystem.getCurrentUsername();
+    printFileResult(fileHandler.savePortfolio(portfolio, currentUser), "Portfolio saved to ");
+}
+
+void searchEntity(User& userSystem, PortfolioManager& portfolio) {
+    string currentUser = userSystem.getCurrentUsername();
+    string name;
+
+    cout << "Enter the name of the entity to search: ";
+    cin >> name;
+
+    FinancialEntity *entity = portfolio.searchEntity(name);
+
+    if (entity)
+    {
+        visitEntity(*entity, [](const auto &concrete) { concrete.showDetails(); });
+    }
+    else
+    {
+        cout << portfolioStatusMessage(PortfolioStatus::NotFound) << "\n";
+
+        // Offer names that start with what was typed, then near misses
+        vector<FinancialEntity *> suggestions = portfolio.searchPrefix(name, 5);
+        if (suggestions.empty()) {
+            suggestions = portfolio.searchFuzzy(name, 2, 5);
+        }
+        if (!suggestions.empty()) {
+            cout << "Did you mean:\n";
+            for (FinancialEntity *suggestion : suggestions) {
+                cout << "  " << suggestion->getNameView() << "\n";
+            }
+        }
+    }
+}
+
+void reportAsOf(PortfolioManager& portfolio, PortfolioAnalytics& portfolioAnalytics) {
+    string date, clock;
+    cout << "Enter date and time (YYYY-MM-DD HH:MM:SS): ";
+    cin >> date >> clock;
+
+    tm when = {};
+    istringstream input(date + " " + clock);
+    input >> get_time(&when, "%Y-%m-%d %H:%M:%S");
+    if (input.fail()) {
+        cout << "Invalid date!\n";
+        return;
+    }
+
+    when.tm_isdst = -1;
+    portfolioAnalytics.showReportAt(portfolio, mktime(&when));
+}
+
+void manageWatchlist(User& userSystem, Watchlist& watchlist, Watchlist& myWatchlist) {
+    string currentUser = userSystem.getCurrentUsername();
+    int watchlistChoice;
+    
+    cout << "\nWatchlist Options:\n";
+    cout << "|1. Add Asset to Watchlist\n";
+    cout << "|2. Remove Asset from Watchlist\n";
+    cout << "|3. Update Asset Price in Watchlist\n";
+    cout << "|4. View Watchlist Performance\n";
+    cout << "|5. Notify Significant Changes in Watchlist\n";
+    cout << "|6. Ingest Price Feed File\n";
+    cout << "Enter your choice: ";
+    cin >> watchlistChoice;
+
+    switch (watchlistChoice) {
+        case 1: {
+            string assetName;
+            double initialPrice;
+            cout << "Enter asset name: ";
+            cin >> assetName;
+            cout << "Enter initial price: ";
+            cin >> initialPrice;
+            myWatchlist.add_asset(currentUser,assetName,initialPrice);
+            break;
+        }
+        case 2: {
+            string assetName;
+            cout << "Enter asset name to remove: ";
+            cin >> assetName;
+            myWatchlist.remove_asset(currentUser,assetName);
+            break;
+        }
+        case 3: {
+            string assetName;
+            double newPrice;
+            cout << "Enter asset name: ";
+            cin >> assetName;
+            cout << "Enter new price: ";
+            cin >> newPrice;
+            myWatchlist.update_price(currentUser,assetName,newPrice);
+        }
+        case 4: {
+            myWatchlist.track_performance(currentUser);
+            break;
+        }
+        case 5: {
+            double threshold;
+            cout << "Enter price change threshold (percentage): ";
+            cin >> threshold;
+            myWatchlist.notify_significant_changes(currentUser,threshold);
+            break;
+        }
+        case 6: {
+            string feedPath;
+            double threshold;
+            cout << "Enter price feed file (asset,price,timestamp per line): ";
+            cin >> feedPath;
+            cout << "Enter price change threshold (percentage): ";
+            cin >> threshold;
+            myWatchlist.ingest_ticks(currentUser,feedPath,threshold);
+            break;
+        }
+        default: 
+            cout << "Invalid Input";
+            break;
+    }
+}
+
+void loginUser(User& userSystem, FileHandler& filehandler, Watchlist& watchlist, Watchlist& myWatchlist, PortfolioAnalytics& portfolioAnalytics) {
+    string currentUser = userSystem.getCurrentUsername();
+
+    // Every session starts from the user's own files, never from what an
+    // earlier session left in memory
+    PortfolioManager portfolio;
+    FileResult restored = filehandler.restorePortfolio(portfolio, currentUser);
+    printFileResult(restored, restored.fromLedger ? "Portfolio rebuilt from " : "Portfolio loaded from ");
+    bool haveLedger = restored.fromLedger;
+    TransactionLedger ledger(TransactionLedger::filenameFor(currentUser));
+    portfolio.attachLedger(&ledger, !haveLedger);
+
+    // Watchlist prices mark linked positions to market
+    uint32_t priceFeed = myWatchlist.subscribe_prices([&portfolio, currentUser](const string& username, const string& asset, double price) {
+        if (username == currentUser) {
+            portfolio.updatePrice(asset, price);
+        }
+    });
+
+    int userChoice;
+    bool loggedIn = true;
+    while (loggedIn)
+    {
+        cout << "\nPortfolio Management Options:\n";
+        cout << "|1. Add Entity\n";
+        cout << "|2. Show Portfolio\n";
+        cout << "|3. Buy Entity\n";
+        cout << "|4. Sell Entity\n";
+        cout << "|5. Save Portfolio\n";
+        cout << "|6. Get Total Value of Portfolio\n";
+        cout << "|7. Search for Entity\n";
+        cout << "|8. Generate Portfolio Report\n";
+        cout << "|9. Show Entity Distribution\n";
+        cout << "|10. Manage Watchlist\n";
+        cout << "|11. Logout\n";
+        cout << "|12. Report As Of Date\n";
+        cout << "|13. Link Entity to Market Price\n";
+        cout << "|14. Show Top Entities by Value\n";
+        cout << "|15. Risk Report\n";
+        cout << "|16. Simulate Scenarios\n";
+        cout << "Enter your choice: ";
+
+        // Closed input logs out, so the session still shuts down cleanly
+        if (!(cin >> userChoice)) {
+            break;
+        }
+
+        try
+        {
+            switch (userChoice) {
+                case 1: // Add Entity
+                    addEntity(portfolio); break;
+                case 2: // Show Portfolio
+                    portfolio.showPortfolio(); break;
+                case 3: // Buy Entity
+                    buyEntity(portfolio); break;
+                case 4: // Sell Entity
+                    sellEntity(portfolio); break;
+                case 5: // Save Portfolio
+                    printFileResult(filehandler.savePortfolio(portfolio, currentUser), "Portfolio saved to "); break;
+                case 6: // Get Total Portfolio Value
+                    getTotalPortfolioValue(userSystem, portfolio, filehandler); break;
+                case 7: // Search for Entity
+                    searchEntity(userSystem, portfolio); break;
+                case 8: // Generate Portfolio Report
+                    portfolioAnalytics.showReport(portfolio); break;
+                case 9: // Show Entity Distribution
+                    portfolioAnalytics.entityDistribution(portfolio); break;
+                case 10: // Manage Watchlist
+                    manageWatchlist(userSystem, watchlist, myWatchlist); break;
+                case 11: // Log out
+                    loggedIn = false; break;
+                case 12: // Report As Of Date
+                    reportAsOf(portfolio, portfolioAnalytics); break;
+                case 13: // Link Entity to Market Price
+                    linkPosition(userSystem, portfolio, myWatchlist); break;
+                case 14: // Show Top Entities by Value
+                    showTopEntities(portfolio); break;
+                case 15: // Risk Report
+                    showRiskReport(portfolio); break;
+                case 16: // Simulate Scenarios
+                    simulateScenarios(portfolio); break;
+                default:
+                    cout << "Invalid choice! Please try again.\n";
+            }
+        } catch (const exception &e) {
+            cout << "An error occurred: " << e.what() << "\n";
+        }
+    }
+
+    myWatchlist.unsubscribe_prices(priceFeed);
+    portfolio.attachLedger(nullptr, false);
+}
+
+// SessionServer hosts many users' portfolios at once. Portfolios are sharded
+// by username across worker threads: each shard thread owns its users'
+// PortfolioManagers outright and runs their commands in order, so
+// independent users proceed in parallel with no global lock. TOTAL, REPORT
+// and SHOW read a ConcurrentPortfolio snapshot on the connection's own
+// thread and never queue behind the shard.
+//
+// Protocol: one command per line, each answered by response lines and a
+// final "END" line.
+//   LOGIN <user> <password>     ADD <name> <value> <type>
+//   BUY <name> <amount>         SELL <name> <amount>
+//   TOP <type> <count> [offset] (by value, largest first)
+//   FIND <prefix|substring|fuzzy> <text> [limit] (ranked name matches)
+//   TOTAL   REPORT   SHOW   SAVE   QUIT
+class SessionServer
+{
+public:
+    struct Session
+    {
+        string username;
+        bool loggedIn = false;
+        const ConcurrentPortfolio *view = nullptr;
+    };
+
+private:
+    struct UserBook
+    {
+        PortfolioManager portfolio;
+        unique_ptr<TransactionLedger> ledger;
+        unique_ptr<ConcurrentPortfolio> view; // trades go through here
+    };
+
+    // Each shard commits its users' ledgers on this interval, so the server
+    // runs one committer per shard rather than one per book
+    static constexpr chrono::milliseconds commitInterval{20};
+
+    struct Shard
+    {
+        thread worker;
+        mutex lock;
+        condition_variable ready;
+        deque<function<void()>> tasks;
+        bool stopping = false;
+        unordered_map<string, unique_ptr<UserBook>> books;
+        FileHandler files;
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    UserIndex users;
+    mutex usersLock;
+
+    // fd is closed and set to -1 under connectionsLock when the client
+    // leaves, so stop() never shuts down a descriptor number reused since
+    struct Connection
+    {
+        thread worker;
+        int fd;
+        bool finished = false;
+    };
+
+    int listenFd = -1;
+    atomic<bool> running{false};
+    mutex connectionsLock;
+    list<Connection> connections;
+
+    static void runShard(Shard &shard)
+    {
+        unique_lock<mutex> guard(shard.lock);
+        auto lastCommit = chrono::steady_clock::now();
+        while (true)
+        {
+            shard.ready.wait_for(guard, commitInterval, [&shard] { return shard.stopping || !shard.tasks.empty(); });
+            if (!shard.tasks.empty())
+            {
+                function<void()> task = std::move(shard.tasks.front());
+                shard.tasks.pop_front();
+                guard.unlock();
+                task();
+                guard.lock();
+            }
+            else if (shard.stopping)
+            {
+                return;
+            }
+
+            // Books are only touched on this thread, so no lock is needed
+            if (chrono::steady_clock::now() - lastCommit >= commitInterval)
+            {
+                guard.unlock();
+                for (auto &book : shard.books)
+                {
+                    book.second->ledger->commit();
+                }
+                guard.lock();
+                lastCommit = chrono::steady_clock::now();
+            }
+        }
+    }
+
+    // Joins the threads of connections that have ended. Caller holds
+    // connectionsLock.
+    void reapConnections()
+    {
+        for (auto it = connections.begin(); it != connections.end();)
+        {
+            if (it->finished)
+            {
+                it->worker.join();
+                it = connections.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    Shard &shardFor(const string &username)
+    {
+        return *shards[hashString(username) % shards.size()];
+    }
+
+    // Runs on the shard thread; opens the user's book on first use
+    static UserBook &bookFor(Shard &shard, const string &username)
+    {
+        auto &book = shard.books[username];
+        if (!book)
+        {
+            book = make_unique<UserBook>();
+            FileResult restored = shard.files.restorePortfolio(book->portfolio, username);
+            for (const string &warning : restored.warnings)
+            {
+                cerr << username << ": " << warning << "\n";
+            }
+            bool haveLedger = restored.fromLedger;
+            book->ledger = make_unique<TransactionLedger>(TransactionLedger::filenameFor(username), 4096, chrono::milliseconds(0));
+            book->portfolio.attachLedger(book->ledger.get(), !haveLedger);
+            book->view = make_unique<ConcurrentPortfolio>(book->portfolio);
+        }
+        return *book;
+    }
+
+    // Runs task(shard, book) on the user's shard thread and waits for it
+    template <typename Result, typename Task>
+    Result runOnShard(const string &username, Task task)
+    {
+        Shard &shard = shardFor(username);
+        promise<Result> reply;
+        future<Result> result = reply.get_future();
+
+        {
+            lock_guard<mutex> guard(shard.lock);
+            shard.tasks.push_back([&shard, &username, &task, &reply] {
+                reply.set_value(task(shard, bookFor(shard, username)));
+            });
+        }
+        shard.ready.notify_one();
+        return result.get();
+    }
+
+    // Read-only commands answered from the latest published version
+    static string readSnapshot(const ConcurrentPortfolio &view, const string &command)
+    {
+        ostringstream out;
+
+        if (command == "TOTAL")
+        {
+            out << "OK " << view.getTotalValue() << "\n";
+        }
+
+        else if (command == "REPORT")
+        {
+            PortfolioTotals totals = view.totals();
+            out << "OK\n";
+            out << "Total Assets: $" << totals.of(EntityType::Asset) << "\n";
+            out << "Total Liabilities: $" << totals.of(EntityType::Liability) << "\n";
+            out << "Total Equities: $" << totals.of(EntityType::Equity) << "\n";
+            out << "Net Portfolio Value: $" << totals.netValue() << "\n";
+        }
+
+        else
+        {
+            ConcurrentPortfolio::Snapshot snapshot = view.snapshot();
+            vector<const ConcurrentPortfolio::Row *> rows;
+            rows.reserve(snapshot->size);
+            for (size_t i = 0; i < snapshot->size; i++)
+            {
+                rows.push_back(&snapshot->row(i));
+            }
+            sort(rows.begin(), rows.end(), [](const auto *a, const auto *b) { return a->name < b->name; });
+
+            out << "OK\n";
+            for (const auto *row : rows)
+            {
+                out << entityTypeName(row->type) << "," << row->name << "," << row->value << "\n";
+            }
+        }
+
+        return out.str();
+    }
+
+    string execute(Shard &shard, UserBook &book, const string &username, const string &command, istringstream &args)
+    {
+        PortfolioManager &portfolio = book.portfolio;
+        ConcurrentPortfolio &view = *book.view;
+        ostringstream out;
+
+        if (command == "ADD")
+        {
+            string name, typeName;
+            double value;
+            EntityType type;
+
+            if (!(args >> name >> value >> typeName) || !parseEntityType(typeName, type))
+            {
+                return "ERR usage: ADD <name> <value> <Asset|Liability|Equity>\n";
+            }
+
+            PortfolioResult result = view.addEntity(name, value, type, rejectOnConflict);
+            if (!result.ok())
+            {
+                return "ERR " + typeName + " value has the wrong sign\n";
+            }
+            out << "OK " << result.entity->getValue() << "\n";
+        }
+
+        else if (command == "BUY" || command == "SELL")
+        {
+            string name;
+            double amount;
+
+            if (!(args >> name >> amount))
+            {
+                return "ERR usage: " + command + " <name> <amount>\n";
+            }
+
+            PortfolioResult result = command == "BUY" ? view.buyEntity(name, amount) : view.sellEntity(name, amount);
+            if (!result.ok())
+            {
+                return "ERR " + string(portfolioStatusMessage(result.status)) + "\n";
+            }
+            out << "OK " << result.entity->getValue() << "\n";
+        }
+
+        else if (command == "TOP")
+        {
+            string typeName;
+            size_t count, offset = 0;
+            EntityType type;
+
+            if (!(args >> typeName >> count) || !parseEntityType(typeName, type))
+            {
+                return "ERR usage: TOP <Asset|Liability|Equity> <count> [offset]\n";
+            }
+            args >> offset;
+
+            out << "OK\n";
+            for (FinancialEntity *entity : portfolio.sortedEntities(type, offset, count))
+            {
+                out << entity->getTypeName() << "," << entity->getNameView() << "," << entity->getValue() << "\n";
+            }
+        }
+
+        else if (command == "FIND")
+        {
+            string mode, text;
+            size_t limit = 20;
 
-    cout << "Enter amount to buy: ";
-    cin >> amount;
+            if (!(args >> mode >> text) || (mode != "prefix" && mode != "substring" && mode != "fuzzy"))
+            {
+                return "ERR usage: FIND <prefix|substring|fuzzy> <text> [limit]\n";
+            }
+            args >> limit;
 
-    portfolio.buyEntity(name, amount);
-}
+            vector<FinancialEntity *> matches = mode == "prefix"    ? portfolio.searchPrefix(text, limit)
+                                                : mode == "substring" ? portfolio.searchSubstring(text, limit)
+                                                                      : portfolio.searchFuzzy(text, 2, limit);
+            out << "OK\n";
+            for (FinancialEntity *entity : matches)
+            {
+                out << entity->getTypeName() << "," << entity->getNameView() << "," << entity->getValue() << "\n";
+            }
+        }
 
-void sellEntity() {
-    PortfolioManager portfolio;
-    FileHandler filehandler;
-    string name;
-    double amount;
+        else if (command == "SAVE")
+        {
+            FileResult saved = shard.files.savePortfolio(portfolio, username);
+            for (const string &warning : saved.warnings)
+            {
+                cerr << username << ": " << warning << "\n";
+            }
+            out << (saved.ok() ? "OK" : "ERR " + string(fileStatusMessage(saved.status))) << "\n";
+        }
 
-    cout << "Enter entity name to sell: ";
-    cin >> name;
+        else
+        {
+            out << "ERR unknown command " << command << "\n";
+        }
 
-    cout << "Enter amount to sell: ";
-    cin >> amount;
+        return out.str();
+    }
 
-    portfolio.sellEntity(name, amount);
-}
+    void serveConnection(Connection &connection)
+    {
+        int fd = connection.fd;
+        Session session;
+        string buffer;
+        char chunk[4096];
 
-void getTotalPortfolioValue(User& userSystem, PortfolioManager& portfolio, FileHandler& fileHandler) {
-    string currentUser = userSystem.getCurrentUsername();
-    fileHandler.savePortfolio(portfolio, currentUser);
-}
+        while (true)
+        {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+            {
+                break;
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
 
-void searchEntity(User& userSystem, PortfolioManager& portfolio) {
-    string currentUser = userSystem.getCurrentUsername();
-    string name;
+            size_t newline;
+            bool quit = false;
+            while ((newline = buffer.find('\n')) != string::npos)
+            {
+                string line = buffer.substr(0, newline);
+                buffer.erase(0, newline + 1);
 
-    cout << "Enter the name of the entity to search: ";
-    cin >> name;
+                string response = handle(session, line) + "END\n";
+                if (::write(fd, response.data(), response.size()) < 0 || line.rfind("QUIT", 0) == 0)
+                {
+                    quit = true;
+                    break;
+                }
+            }
 
-    FinancialEntity *entity = portfolio.searchEntity(name);
+            if (quit)
+            {
+                break;
+            }
+        }
 
-    if (entity)
+        lock_guard<mutex> guard(connectionsLock);
+        ::close(fd);
+        connection.fd = -1;
+        connection.finished = true;
+    }
+
+public:
+    explicit SessionServer(size_t shardCount = thread::hardware_concurrency())
     {
-        entity->showDetails();
+        shardCount = max<size_t>(1, shardCount);
+        for (size_t i = 0; i < shardCount; i++)
+        {
+            shards.push_back(make_unique<Shard>());
+            Shard &shard = *shards.back();
+            shard.worker = thread(runShard, ref(shard));
+        }
     }
-}
 
-void manageWatchlist(User& userSystem, Watchlist& watchlist, Watchlist& myWatchlist) {
-    string currentUser = userSystem.getCurrentUsername();
-    int watchlistChoice;
-    
-    cout << "\nWatchlist Options:\n";
-    cout << "|1. Add Asset to Watchlist\n";
-    cout << "|2. Remove Asset from Watchlist\n";
-    cout << "|3. Update Asset Price in Watchlist\n";
-    cout << "|4. View Watchlist Performance\n";
-    cout << "|5. Notify Significant Changes in Watchlist\n";
-    cout << "Enter your choice: ";
-    cin >> watchlistChoice;
+    SessionServer(const SessionServer &) = delete;
+    SessionServer &operator=(const SessionServer &) = delete;
 
-    switch (watchlistChoice) {
-        case 1: {
-            string assetName;
-            double initialPrice;
-            cout << "Enter asset name: ";
-            cin >> assetName;
-            cout << "Enter initial price: ";
-            cin >> initialPrice;
-            myWatchlist.add_asset(currentUser,assetName,initialPrice);
-            break;
+    ~SessionServer()
+    {
+        stop();
+
+        for (auto &shard : shards)
+        {
+            {
+                lock_guard<mutex> guard(shard->lock);
+                shard->stopping = true;
+            }
+            shard->ready.notify_one();
+            shard->worker.join();
+
+            // Detach ledgers before the books go away
+            for (auto &book : shard->books)
+            {
+                book.second->portfolio.attachLedger(nullptr, false);
+            }
         }
-        case 2: {
-            string assetName;
-            cout << "Enter asset name to remove: ";
-            cin >> assetName;
-            myWatchlist.remove_asset(currentUser,assetName);
-            break;
+    }
+
+    // Handles one protocol line for a session; the caller appends "END"
+    string handle(Session &session, const string &line)
+    {
+        istringstream args(line);
+        string command;
+        args >> command;
+
+        if (command == "LOGIN")
+        {
+            string username, password;
+            args >> username >> password;
+
+            {
+                lock_guard<mutex> guard(usersLock);
+                if (!users.checkPassword(username, password))
+                {
+                    return "ERR Invalid username or password.\n";
+                }
+            }
+
+            session.username = username;
+            session.loggedIn = true;
+            session.view = runOnShard<const ConcurrentPortfolio *>(username, [](Shard &, UserBook &book) { return book.view.get(); });
+            return "OK Welcome, " + username + ".\n";
         }
-        case 3: {
-            string assetName;
-            double newPrice;
-            cout << "Enter asset name: ";
-            cin >> assetName;
-            cout << "Enter new price: ";
-            cin >> newPrice;
-            myWatchlist.update_price(currentUser,assetName,newPrice);
+
+        if (command == "QUIT")
+        {
+            return "OK\n";
         }
-        case 4: {
-            myWatchlist.track_performance(currentUser);
-            break;
+
+        if (!session.loggedIn)
+        {
+            return "ERR not logged in\n";
         }
-        case 5: {
-            double threshold;
-            cout << "Enter price change threshold (percentage): ";
-            cin >> threshold;
-            myWatchlist.notify_significant_changes(currentUser,threshold);
-            break;
+
+        if (command == "TOTAL" || command == "REPORT" || command == "SHOW")
+        {
+            return readSnapshot(*session.view, command);
         }
-        default: 
-            cout << "Invalid Input";
-            break;
+
+        return runOnShard<string>(session.username, [&](Shard &shard, UserBook &book) {
+            return execute(shard, book, session.username, command, args);
+        });
     }
-}
 
-void loginUser(User& userSystem, PortfolioManager& portfolio, FileHandler& filehandler, Watchlist& watchlist, Watchlist& myWatchlist, PortfolioAnalytics& portfolioAnalytics) {
-    string currentUser = userSystem.getCurrentUsername();
-    filehandler.loadPortfolio(portfolio, currentUser);
+    // Accepts clients on a Unix domain socket until stop(); one thread per
+    // connection reads requests and hands them to the shards. Returns false
+    // if the socket cannot be set up or accept fails for good.
+    bool serve(const string &socketPath)
+    {
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0)
+        {
+            return false;
+        }
 
-    int userChoice;
-    while (true)
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        ::unlink(socketPath.c_str());
+
+        if (::bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listenFd, 128) != 0)
+        {
+            ::close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+
+        running = true;
+        while (running)
+        {
+            int client = ::accept(listenFd, nullptr, nullptr);
+            if (client < 0)
+            {
+                if (!running || errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+
+                // Out of descriptors or memory: wait for clients to leave
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                {
+                    this_thread::sleep_for(chrono::milliseconds(100));
+                    lock_guard<mutex> guard(connectionsLock);
+                    reapConnections();
+                    continue;
+                }
+
+                cerr << "accept failed: " << strerror(errno) << "\n";
+                if (running.exchange(false))
+                {
+                    ::close(listenFd);
+                }
+                return false;
+            }
+
+            lock_guard<mutex> guard(connectionsLock);
+            if (!running)
+            {
+                ::close(client);
+                break;
+            }
+
+            reapConnections();
+            Connection &connection = connections.emplace_back();
+            connection.fd = client;
+            connection.worker = thread(&SessionServer::serveConnection, this, ref(connection));
+        }
+        return true;
+    }
+
+    void stop()
     {
-        cout << "\nPortfolio Management Options:\n";
-        cout << "|1. Add Entity\n";
-        cout << "|2. Show Portfolio\n";
-        cout << "|3. Buy Entity\n";
-        cout << "|4. Sell Entity\n";
-        cout << "|5. Save Portfolio\n";
-        cout << "|6. Get Total Value of Portfolio\n";
-        cout << "|7. Search for Entity\n";
-        cout << "|8. Generate Portfolio Report\n";
-        cout << "|9. Show Entity Distribution\n";
-        cout << "|10. Manage Watchlist\n";
-        cout << "|11. Logout\n";
-        cout << "Enter your choice: ";
-        cin >> userChoice;
+        if (running.exchange(false))
+        {
+            ::shutdown(listenFd, SHUT_RDWR);
+            ::close(listenFd);
+        }
 
-        try
+        // Threads take connectionsLock on the way out, so join outside it
+        list<Connection> ending;
         {
-            switch (userChoice) {
-                case 1: // Add Entity
-                    addEntity(); break;
-                case 2: // Show Portfolio
-                    portfolio.showPortfolio(); break;
-                case 3: // Buy Entity
-                    buyEntity(); break;
-                case 4: // Sell Entity
-                    sellEntity(); break;
-                case 5: // Save Portfolio
-                    filehandler.savePortfolio(portfolio, currentUser); break;
-                case 6: // Get Total Portfolio Value
-                    getTotalPortfolioValue(userSystem, portfolio, filehandler); break;
-                case 7: // Search for Entity
-                    searchEntity(userSystem, portfolio); break;
-                case 8: // Generate Portfolio Report
-                    portfolioAnalytics.showReport(portfolio); break;
-                case 9: // Show Entity Distribution
-                    portfolioAnalytics.entityDistribution(portfolio); break;
-                case 10: // Manage Watchlist
-                    manageWatchlist(userSystem, watchlist, myWatchlist); break;
-                case 11: // Log out
-                    break;
-                default:
-                    cout << "Invalid choice! Please try again.\n";
+            lock_guard<mutex> guard(connectionsLock);
+            for (Connection &connection : connections)
+            {
+                if (connection.fd >= 0)
+                {
+                    ::shutdown(connection.fd, SHUT_RDWR);
+                }
             }
-        } catch (const exception &e) {
-            cout << "An error occurred: " << e.what() << "\n";
+            ending.splice(ending.end(), connections);
+        }
+
+        for (Connection &connection : ending)
+        {
+            connection.worker.join();
+        }
+    }
+};
+
+// In-process stand-in for a socket client; drives a SessionServer directly
+class LoopbackClient
+{
+private:
+    SessionServer &server;
+    SessionServer::Session session;
+
+public:
+    explicit LoopbackClient(SessionServer &server) : server(server) {}
+
+    string send(const string &line)
+    {
+        return server.handle(session, line);
+    }
+};
+
+// Sends stdin lines to a server socket and prints each response
+int runClient(const string &socketPath)
+{
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        cout << "Could not connect to " << socketPath << "\n";
+        return 1;
+    }
+
+    string line, pending;
+    char chunk[4096];
+    while (getline(cin, line))
+    {
+        line += "\n";
+        if (::write(fd, line.data(), line.size()) < 0)
+        {
+            break;
+        }
+
+        // Read until the END terminator of this response
+        while (pending.find("END\n") == string::npos)
+        {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+            {
+                ::close(fd);
+                return 0;
+            }
+            pending.append(chunk, static_cast<size_t>(n));
         }
+
+        size_t end = pending.find("END\n");
+        cout << pending.substr(0, end);
+        pending.erase(0, end + 4);
+    }
+
+    ::close(fd);
+    return 0;
+}
+
+// Non-interactive entry points:
+//   ingest <username> <feed file | -> [threshold]
+//   serve <socket path> [worker threads]
+//   client <socket path>
+//   firm-report [worker threads]
+int runCommand(int argc, char *argv[])
+{
+    string command = argv[1];
+
+    if (command == "firm-report" && argc <= 3)
+    {
+        UserIndex users;
+        WorkStealingPool pool(argc == 3 ? static_cast<size_t>(atoi(argv[2])) : thread::hardware_concurrency());
+        FirmAnalytics::show(FirmAnalytics::build(users.usernames(), pool));
+        return 0;
     }
+
+    if (command == "serve" && (argc == 3 || argc == 4))
+    {
+        SessionServer server(argc == 4 ? static_cast<size_t>(atoi(argv[3])) : thread::hardware_concurrency());
+        cerr << "Listening on " << argv[2] << "\n";
+        return server.serve(argv[2]) ? 0 : 1;
+    }
+
+    if (command == "client" && argc == 3)
+    {
+        return runClient(argv[2]);
+    }
+
+    if (command == "ingest" && (argc == 4 || argc == 5))
+    {
+        Watchlist watchlist(false);
+        double threshold = argc == 5 ? atof(argv[4]) : -1;
+        watchlist.ingest_ticks(argv[2], argv[3], threshold);
+        return 0;
+    }
+
+    cout << "Usage: " << argv[0] << " ingest <username> <feed file | -> [threshold]\n"
+         << "       " << argv[0] << " serve <socket path> [worker threads]\n"
+         << "       " << argv[0] << " client <socket path>\n"
+         << "       " << argv[0] << " firm-report [worker threads]\n";
+    return 1;
 }
 
-int main()
+// Builds that embed this file (such as benchmarks.cpp) define PMS_NO_MAIN
+#ifndef PMS_NO_MAIN
+int main(int argc, char *argv[])
 {
+    if (argc > 1)
+    {
+        return runCommand(argc, argv);
+    }
+
     User userSystem;
-    PortfolioManager portfolio;
     FileHandler fileHandler;
     Watchlist watchlist;
     Watchlist myWatchlist;
@@ -929,14 +7207,17 @@ int main()
     try
     {
         int choice;
+        bool running = true;
 
-        while (true)
+        while (running)
         {
             cout << "\n|1. Register\n";
             cout << "|2. Login\n";
             cout << "|3. Exit\n";
             cout << "Enter your choice: ";
-            cin >> choice;
+            if (!(cin >> choice)) {
+                break;
+            }
 
             // Convert nested if-else statements to switch-case
             switch (choice) {
@@ -944,10 +7225,10 @@ int main()
                     userSystem.registerUser();
                     break;
                 case 2: {
-                    if (userSystem.loginUser()) { loginUser(userSystem, portfolio, fileHandler, watchlist, myWatchlist, portfolioAnalytics); }
+                    if (userSystem.loginUser()) { loginUser(userSystem, fileHandler, watchlist, myWatchlist, portfolioAnalytics); }
                     break;
                 }
-                case 3: break;
+                case 3: running = false; break;
                 default: cout << "Invalid choice! Please try again.\n"; break;
             }
         }
@@ -960,3 +7241,4 @@ int main()
 
     return 0;
 }
+#endif